@@ -0,0 +1,273 @@
+/*
+ * async_logger.hpp
+ */
+
+#ifndef INCLUDE_ASYNC_LOGGER_HPP_
+#define INCLUDE_ASYNC_LOGGER_HPP_
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <cstdint>
+#include <sstream>
+#include <iostream>
+#include <condition_variable>
+
+
+enum log_level_e {
+	LOG_INFO,
+	LOG_ERROR
+};
+
+/*
+ * Bounded multi-producer queue of log lines, printed by a background thread.
+ * log() never blocks: if the queue is full the line is dropped and counted instead.
+ * Lines go to stdout (info) or stderr (error), as plain text or one JSON object per line.
+ */
+class AsyncLogger {
+public:
+	/*
+	 * Collects one line via operator<<, which is queued when it goes out of scope.
+	 */
+	class line_t {
+	public:
+		line_t(AsyncLogger* logger, const log_level_e level)
+			:	logger(logger), level(level)
+		{
+		}
+
+		line_t(line_t&& other)
+			:	logger(other.logger), level(other.level), out(std::move(other.out))
+		{
+			other.logger = nullptr;
+		}
+
+		line_t(const line_t&) = delete;
+		line_t& operator=(const line_t&) = delete;
+
+		~line_t() {
+			if(logger) {
+				logger->log(level, out.str());
+			}
+		}
+
+		template<typename T>
+		line_t& operator<<(const T& value) {
+			out << value;
+			return *this;
+		}
+
+	private:
+		AsyncLogger* logger = nullptr;
+		log_level_e level = LOG_INFO;
+		std::ostringstream out;
+	};
+
+	AsyncLogger(const size_t capacity = 4096)
+		:	ring(get_power_of_two(capacity)),
+			mask(ring.size() - 1)
+	{
+		for(size_t i = 0; i < ring.size(); ++i) {
+			ring[i].seq.store(i, std::memory_order_relaxed);
+		}
+		thread = std::thread(&AsyncLogger::flush_loop, this);
+	}
+
+	AsyncLogger(const AsyncLogger&) = delete;
+	AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+	~AsyncLogger()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			do_run = false;
+		}
+		signal.notify_all();
+		thread.join();
+	}
+
+	line_t info() {
+		return line_t(this, LOG_INFO);
+	}
+
+	line_t error() {
+		return line_t(this, LOG_ERROR);
+	}
+
+	/*
+	 * Queues one line, without trailing newline. Returns false if it was dropped.
+	 */
+	bool log(const log_level_e level, std::string message)
+	{
+		// Vyukov's bounded queue: claim a slot by bumping `head`, publish it via the slot's sequence
+		slot_t* slot = nullptr;
+		auto pos = head.load(std::memory_order_relaxed);
+		while(true) {
+			slot = &ring[pos & mask];
+			const auto seq = slot->seq.load(std::memory_order_acquire);
+			const auto diff = int64_t(seq) - int64_t(pos);
+			if(diff == 0) {
+				if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if(diff < 0) {
+				num_dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		slot->level = level;
+		slot->time = std::chrono::system_clock::now();
+		slot->message = std::move(message);
+		slot->seq.store(pos + 1, std::memory_order_release);
+
+		if(is_idle.load(std::memory_order_relaxed)) {
+			signal.notify_one();
+		}
+		return true;
+	}
+
+	/*
+	 * Blocks until all lines queued so far have been printed.
+	 */
+	void flush()
+	{
+		const auto end = head.load(std::memory_order_acquire);
+		std::unique_lock<std::mutex> lock(mutex);
+		signal.notify_all();
+		while(tail.load(std::memory_order_acquire) < end && do_run) {
+			flushed.wait_for(lock, std::chrono::milliseconds(10));
+		}
+	}
+
+	void set_json(const bool enable) {
+		is_json = enable;
+	}
+
+	uint64_t get_num_dropped() const {
+		return num_dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct slot_t {
+		std::atomic<size_t> seq {0};
+		log_level_e level = LOG_INFO;
+		std::chrono::system_clock::time_point time;
+		std::string message;
+	};
+
+	static size_t get_power_of_two(const size_t n) {
+		size_t out = 2;
+		while(out < n) {
+			out <<= 1;
+		}
+		return out;
+	}
+
+	static std::string escape_json(const std::string& str)
+	{
+		std::string out;
+		for(const auto c : str) {
+			switch(c) {
+				case '"': out += "\\\""; break;
+				case '\\': out += "\\\\"; break;
+				case '\n': out += "\\n"; break;
+				case '\r': out += "\\r"; break;
+				case '\t': out += "\\t"; break;
+				default:
+					if((unsigned char)c < 0x20) {
+						char buf[8];
+						::snprintf(buf, sizeof(buf), "\\u%04x", c);
+						out += buf;
+					} else {
+						out += c;
+					}
+			}
+		}
+		return out;
+	}
+
+	void print(const slot_t& slot)
+	{
+		auto& out = slot.level == LOG_ERROR ? std::cerr : std::cout;
+		if(is_json) {
+			const auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(slot.time.time_since_epoch()).count();
+			const std::time_t sec = millis / 1000;
+			std::tm tm = {};
+#ifdef _WIN32
+			::gmtime_s(&tm, &sec);
+#else
+			::gmtime_r(&sec, &tm);
+#endif
+			char buf[64];
+			::snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+					tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, int(millis % 1000));
+			out << "{\"time\":\"" << buf << "\",\"level\":\"" << (slot.level == LOG_ERROR ? "error" : "info")
+				<< "\",\"msg\":\"" << escape_json(slot.message) << "\"}\n";
+		} else {
+			out << slot.message << "\n";
+		}
+	}
+
+	void flush_loop()
+	{
+		while(true) {
+			bool is_empty = true;
+			while(true) {
+				const auto pos = tail.load(std::memory_order_relaxed);
+				auto& slot = ring[pos & mask];
+				if(slot.seq.load(std::memory_order_acquire) != pos + 1) {
+					break;
+				}
+				print(slot);
+				slot.message.clear();
+				slot.seq.store(pos + ring.size(), std::memory_order_release);
+				tail.store(pos + 1, std::memory_order_release);
+				is_empty = false;
+			}
+			if(!is_empty) {
+				std::cout.flush();
+				std::cerr.flush();
+				flushed.notify_all();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			const auto pos = tail.load(std::memory_order_relaxed);
+			if(!do_run && ring[pos & mask].seq.load(std::memory_order_acquire) != pos + 1) {
+				break;
+			}
+			is_idle = true;
+			// producers only notify when idle, the timeout covers a notify racing with this wait
+			signal.wait_for(lock, std::chrono::milliseconds(100));
+			is_idle = false;
+		}
+		flushed.notify_all();
+	}
+
+private:
+	std::vector<slot_t> ring;
+	const size_t mask;
+
+	std::atomic<size_t> head {0};
+	std::atomic<uint64_t> num_dropped {0};
+	std::atomic<bool> is_idle {false};
+	std::atomic<bool> is_json {false};
+
+	std::atomic<size_t> tail {0};		// only advanced by flusher thread
+	bool do_run = true;
+
+	std::mutex mutex;
+	std::condition_variable signal;
+	std::condition_variable flushed;
+	std::thread thread;
+
+};
+
+
+#endif // INCLUDE_ASYNC_LOGGER_HPP_
@@ -0,0 +1,90 @@
+/*
+ * block_device.hpp
+ */
+
+#ifndef INCLUDE_BLOCK_DEVICE_HPP_
+#define INCLUDE_BLOCK_DEVICE_HPP_
+
+#include <string>
+#include <cctype>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#endif
+
+
+struct block_device_t {
+	std::string name;			// whole disk, ie. "sda" for "/dev/sda1"
+	std::string controller;		// PCI address of the disk's controller, empty if unknown
+};
+
+
+inline
+bool is_pci_address(const std::string& str)
+{
+	// ie. "0000:00:1f.2"
+	if(str.size() != 12 || str[4] != ':' || str[7] != ':' || str[10] != '.') {
+		return false;
+	}
+	for(size_t i = 0; i < str.size(); ++i) {
+		if(i != 4 && i != 7 && i != 10 && !::isxdigit(str[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Resolves the physical disk a directory is stored on, via st_dev and sysfs.
+ * Partitions resolve to their disk, so directories on different partitions of one disk end up in the same group.
+ * Falls back to "major:minor" if the device is not in sysfs (ie. tmpfs, network file systems),
+ * or to the path itself on other platforms.
+ */
+inline
+block_device_t get_block_device(const std::string& path)
+{
+	block_device_t out;
+#ifdef __linux__
+	struct stat info = {};
+	if(::stat(path.c_str(), &info)) {
+		out.name = path;
+		return out;
+	}
+	const auto dev_id = std::to_string(major(info.st_dev)) + ":" + std::to_string(minor(info.st_dev));
+	out.name = dev_id;
+
+	char buf[PATH_MAX] = {};
+	if(!::realpath(("/sys/dev/block/" + dev_id).c_str(), buf)) {
+		return out;
+	}
+	std::string sys_path(buf);
+	if(::access((sys_path + "/partition").c_str(), F_OK) == 0) {
+		sys_path = sys_path.substr(0, sys_path.rfind('/'));
+	}
+	out.name = sys_path.substr(sys_path.rfind('/') + 1);
+
+	// the controller is the last PCI device on the path, ie. /sys/devices/pci0000:00/0000:00:1f.2/ata1/.../block/sda
+	size_t pos = 0;
+	while(pos < sys_path.size()) {
+		auto next = sys_path.find('/', pos);
+		if(next == std::string::npos) {
+			next = sys_path.size();
+		}
+		const auto part = sys_path.substr(pos, next - pos);
+		if(is_pci_address(part)) {
+			out.controller = part;
+		}
+		pos = next + 1;
+	}
+#else
+	out.name = path;
+#endif
+	return out;
+}
+
+
+#endif // INCLUDE_BLOCK_DEVICE_HPP_
@@ -0,0 +1,224 @@
+/*
+ * buffer_pool.hpp
+ */
+
+#ifndef INCLUDE_BUFFER_POOL_HPP_
+#define INCLUDE_BUFFER_POOL_HPP_
+
+#include <buffer_ring.hpp>
+
+#include <string>
+#include <cstring>
+#include <vector>
+#include <mutex>
+#include <stdexcept>
+#include <condition_variable>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+
+/*
+ * Preallocated arena of fixed size slabs, shared by all copies to cap total buffer memory.
+ * Optionally backed by huge pages and locked into RAM.
+ */
+class BufferPool {
+public:
+	BufferPool(const size_t slab_size, const size_t num_slabs, const bool huge_pages, const bool lock_memory)
+		:	slab_size(slab_size),
+			num_slabs(std::max<size_t>(num_slabs, 1))
+	{
+		total_size = slab_size * this->num_slabs;
+#ifdef _WIN32
+		arena = (char*)::malloc(total_size);
+		if(!arena) {
+			throw std::runtime_error("malloc() failed for buffer pool");
+		}
+#else
+		if(huge_pages) {
+			const size_t huge_size = 2 * 1024 * 1024;
+			const auto size = ((total_size + huge_size - 1) / huge_size) * huge_size;
+			auto* ptr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+			if(ptr != MAP_FAILED) {
+				arena = (char*)ptr;
+				total_size = size;
+				is_huge = true;
+			}
+		}
+		if(!arena) {
+			auto* ptr = ::mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+			if(ptr == MAP_FAILED) {
+				throw std::runtime_error("mmap() failed for buffer pool with: " + std::string(strerror(errno)));
+			}
+			arena = (char*)ptr;
+#ifdef MADV_HUGEPAGE
+			if(huge_pages) {
+				::madvise(arena, total_size, MADV_HUGEPAGE);		// transparent huge pages as fallback
+			}
+#endif
+		}
+		if(lock_memory) {
+			if(::mlock(arena, total_size)) {
+				lock_error = std::string(strerror(errno));
+			} else {
+				is_locked = true;
+			}
+		}
+#endif
+		for(size_t i = 0; i < this->num_slabs; ++i) {
+			free_list.push_back(arena + i * slab_size);
+		}
+	}
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	~BufferPool()
+	{
+#ifdef _WIN32
+		::free(arena);
+#else
+		::munmap(arena, total_size);
+#endif
+	}
+
+	/*
+	 * Returns `count` slabs at once, blocks until enough are available.
+	 * Taking all slabs of a copy in one step avoids deadlocks between copies holding partial sets.
+	 */
+	std::vector<buffer_t> acquire(size_t count)
+	{
+		count = std::min(std::max<size_t>(count, 1), num_slabs);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while(free_list.size() < count) {
+			num_waits++;
+			signal.wait(lock);
+		}
+		return take(count);
+	}
+
+	/*
+	 * Returns empty vector if not enough slabs are available.
+	 */
+	std::vector<buffer_t> try_acquire(const size_t count)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!count || free_list.size() < count) {
+			return {};
+		}
+		return take(count);
+	}
+
+	void release(const std::vector<buffer_t>& list)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for(const auto& buf : list) {
+				free_list.push_back(buf.data);
+			}
+		}
+		signal.notify_all();
+	}
+
+	size_t get_slab_size() const {
+		return slab_size;
+	}
+
+	size_t get_num_slabs() const {
+		return num_slabs;
+	}
+
+	size_t get_num_free() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return free_list.size();
+	}
+
+	size_t get_num_waits() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return num_waits;
+	}
+
+	bool is_huge_pages() const {
+		return is_huge;
+	}
+
+	bool is_memory_locked() const {
+		return is_locked;
+	}
+
+	const std::string& get_lock_error() const {
+		return lock_error;
+	}
+
+private:
+	std::vector<buffer_t> take(const size_t count)
+	{
+		std::vector<buffer_t> out(count);
+		for(auto& buf : out) {
+			buf.data = free_list.back();
+			buf.capacity = slab_size;
+			free_list.pop_back();
+		}
+		return out;
+	}
+
+private:
+	const size_t slab_size;
+	const size_t num_slabs;
+	size_t total_size = 0;
+	char* arena = nullptr;
+	bool is_huge = false;
+	bool is_locked = false;
+	std::string lock_error;
+
+	mutable std::mutex mutex;
+	std::condition_variable signal;
+	std::vector<char*> free_list;
+	size_t num_waits = 0;
+
+};
+
+
+/*
+ * Buffers borrowed by one copy, returned to the pool on destruction.
+ * Without a pool the buffers are allocated individually.
+ */
+class BufferLease {
+public:
+	BufferLease(BufferPool* pool, const size_t count, const size_t buffer_size)
+		:	pool(pool)
+	{
+		if(pool) {
+			buffers = pool->acquire(count);
+		} else {
+			storage.resize(count, std::vector<char>(buffer_size));
+			for(auto& entry : storage) {
+				buffer_t buf;
+				buf.data = entry.data();
+				buf.capacity = entry.size();
+				buffers.push_back(buf);
+			}
+		}
+	}
+
+	BufferLease(const BufferLease&) = delete;
+	BufferLease& operator=(const BufferLease&) = delete;
+
+	~BufferLease() {
+		if(pool) {
+			pool->release(buffers);
+		}
+	}
+
+	std::vector<buffer_t> buffers;
+
+private:
+	BufferPool* pool = nullptr;
+	std::vector<std::vector<char>> storage;
+
+};
+
+
+#endif // INCLUDE_BUFFER_POOL_HPP_
@@ -0,0 +1,114 @@
+/*
+ * buffer_ring.hpp
+ */
+
+#ifndef INCLUDE_BUFFER_RING_HPP_
+#define INCLUDE_BUFFER_RING_HPP_
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+
+
+struct buffer_t {
+	char* data = nullptr;
+	size_t capacity = 0;
+	size_t size = 0;
+};
+
+
+/*
+ * Bounded FIFO between threads, push() blocks while full and pop() blocks while empty.
+ * Keeps track of how long pop() had to wait, ie. how long the consumer was starved.
+ * Waiters are notified while holding the lock, so the ring may be destroyed as soon as the item a thread waited for was popped,
+ * even though the other thread is still returning from push().
+ */
+template<typename T>
+class BufferRing {
+public:
+	BufferRing(const size_t capacity)
+		:	ring(std::max<size_t>(capacity, 1))
+	{
+	}
+
+	/*
+	 * Returns false if the ring has been closed.
+	 */
+	bool push(const T& item)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while(!is_closed && count == ring.size()) {
+				signal.wait(lock);
+			}
+			if(is_closed) {
+				return false;
+			}
+			ring[(head + count) % ring.size()] = item;
+			count++;
+			signal.notify_all();
+		}
+		return true;
+	}
+
+	/*
+	 * Returns false if the ring has been closed and is empty.
+	 */
+	bool pop(T& item)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if(!count && !is_closed) {
+				const auto time_begin = std::chrono::steady_clock::now();
+				while(!count && !is_closed) {
+					signal.wait(lock);
+				}
+				wait_time += std::chrono::steady_clock::now() - time_begin;
+			}
+			if(!count) {
+				return false;
+			}
+			item = ring[head];
+			head = (head + 1) % ring.size();
+			count--;
+			signal.notify_all();
+		}
+		return true;
+	}
+
+	/*
+	 * No more items will be pushed, pending items can still be popped.
+	 */
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			is_closed = true;
+			signal.notify_all();
+		}
+	}
+
+	/*
+	 * Returns total time spent waiting in pop() [sec].
+	 */
+	double get_wait_time() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return std::chrono::duration<double>(wait_time).count();
+	}
+
+private:
+	mutable std::mutex mutex;
+	std::condition_variable signal;
+	std::vector<T> ring;
+	size_t head = 0;
+	size_t count = 0;
+	bool is_closed = false;
+	std::chrono::steady_clock::duration wait_time = {};
+
+};
+
+
+#endif // INCLUDE_BUFFER_RING_HPP_
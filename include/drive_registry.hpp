@@ -0,0 +1,458 @@
+/*
+ * drive_registry.hpp
+ */
+
+#ifndef INCLUDE_DRIVE_REGISTRY_HPP_
+#define INCLUDE_DRIVE_REGISTRY_HPP_
+
+#include <parallel_tuner.hpp>
+#include <block_device.hpp>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <experimental/filesystem>
+
+
+struct drive_t {
+	size_t index = 0;
+	std::string path;
+	uint64_t available = 0;			// free space as of last refresh, minus copies finished since
+	uint64_t reserved = 0;			// bytes reserved by active copies
+	uint64_t allocated = 0;			// part of `reserved` taken from free space already (preallocated)
+	int64_t num_active = 0;			// number of active copies
+	size_t device = 0;				// index of physical device
+	std::string device_name;
+	std::string controller;			// PCI address of controller, empty if unknown
+	int64_t device_active = 0;		// number of active copies on the whole device
+	uint64_t device_reserved = 0;	// bytes reserved on the whole device
+	int max_active = -1;			// limit of parallel copies per device, -1 = unlimited
+	uint64_t last_select = 0;		// sequence number of last reservation, 0 = never
+	size_t num_jobs = 0;			// finished copies
+	uint64_t num_bytes = 0;			// bytes written by finished copies
+	double total_sec = 0;			// time spent by finished copies
+	double throughput = 0;			// moving average of write throughput [bytes/sec], 0 = unknown
+	bool is_failed = false;			// write error, never used again
+	bool is_disabled = false;		// disable marker file present
+	bool is_valid = false;			// free space could be determined
+	bool is_removed = false;		// no longer configured, active copies drain
+
+	/*
+	 * Returns true if `num_bytes` fit in addition to what is reserved already.
+	 * Preallocated files are missing from `available` already, so only the rest of their reservation counts.
+	 */
+	bool can_fit(const uint64_t num_bytes) const {
+		return is_usable() && available > reserved - allocated + num_bytes + 4096;
+	}
+
+	bool is_usable() const {
+		return is_valid && !is_failed && !is_disabled && !is_removed;
+	}
+
+	bool has_free_slot() const {
+		return device_active < max_active || max_active < 0;
+	}
+
+	/*
+	 * Returns recent write throughput [bytes/sec], 0 if unknown.
+	 */
+	double get_throughput() const {
+		return throughput;
+	}
+};
+
+
+struct drive_status_t {
+	uint64_t available = 0;			// free space [bytes]
+	bool is_valid = false;			// free space could be determined
+	bool is_disabled = false;		// disable marker file present
+};
+
+/*
+ * Source of free space, disable markers and physical device of a drive.
+ */
+class DriveProvider {
+public:
+	virtual ~DriveProvider() {}
+
+	virtual drive_status_t get_status(const std::string& path) = 0;
+
+	virtual block_device_t get_device(const std::string& path) = 0;
+
+};
+
+/*
+ * Queries the real file system, via statvfs() and sysfs.
+ */
+class FileSystemProvider : public DriveProvider {
+public:
+	drive_status_t get_status(const std::string& path) override
+	{
+		drive_status_t out;
+		const auto prefix = path + char(std::experimental::filesystem::path::preferred_separator);
+		try {
+			out.available = std::experimental::filesystem::space(path).available;
+			out.is_valid = out.available > 0;
+		} catch(...) {
+			// not mounted or no access
+		}
+		try {
+			out.is_disabled =
+					std::experimental::filesystem::exists(prefix + "chia_plot_sink_disable")
+				||	std::experimental::filesystem::exists(prefix + "chia_plot_sink_disable.txt");
+		} catch(...) {
+			// ignore
+		}
+		return out;
+	}
+
+	block_device_t get_device(const std::string& path) override {
+		return get_block_device(path);
+	}
+
+};
+
+
+/*
+ * Table of destination drives with cached free space, so selecting a drive does not touch the file system.
+ * Free space and disable markers are refreshed by a background thread every `refresh_sec` seconds,
+ * in between the table is kept up to date from reservations and finished copies.
+ * Drives are grouped by physical device (unless `group_devices` is false), parallel copies are limited per device.
+ * With `adaptive` the parallel copies limit of each device is tuned at runtime, up to `max_num_active`.
+ * With `refresh_sec` <= 0 there is no background thread, refresh() has to be called explicitly.
+ * Drive state is queried via `provider`, which defaults to the real file system.
+ */
+class DriveRegistry {
+public:
+	typedef std::function<int(const std::vector<drive_t>& drives)> select_t;
+
+	static constexpr double ewma_weight = 0.3;		// weight of newest sample
+
+	DriveRegistry(	const std::vector<std::string>& paths, const int max_num_active, const bool adaptive, const bool group_devices,
+					const int refresh_sec, const std::function<void()>& on_refresh = nullptr,
+					std::shared_ptr<DriveProvider> provider = nullptr)
+		:	max_num_active(max_num_active),
+			adaptive(adaptive),
+			group_devices(group_devices),
+			refresh_sec(refresh_sec),
+			on_refresh(on_refresh),
+			provider(provider ? provider : std::make_shared<FileSystemProvider>())
+	{
+		for(const auto& path : paths) {
+			add_drive_unlocked(path);
+		}
+		time_last = std::chrono::steady_clock::now();
+		refresh();
+		if(refresh_sec > 0) {
+			thread = std::thread(&DriveRegistry::refresh_loop, this);
+		}
+	}
+
+	DriveRegistry(const DriveRegistry&) = delete;
+	DriveRegistry& operator=(const DriveRegistry&) = delete;
+
+	~DriveRegistry()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			do_run = false;
+		}
+		signal.notify_all();
+		if(thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	size_t size() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return drives.size();
+	}
+
+	drive_t get(const size_t index) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return drives.at(index);
+	}
+
+	std::string get_path(const size_t index) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return drives.at(index).path;
+	}
+
+	std::vector<drive_t> get_all() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return drives;
+	}
+
+	/*
+	 * Calls `select` on the current table and reserves `num_bytes` on the drive it returns.
+	 * Returns the drive index, or -1 if `select` did not find one.
+	 */
+	int reserve(const uint64_t num_bytes, const select_t& select)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto index = select(drives);
+		if(index >= 0) {
+			update_active_time();
+			auto& drive = drives.at(index);
+			drive.reserved += num_bytes;
+			drive.num_active++;
+			drive.last_select = ++select_counter;
+			auto& dev = devices[drive.device];
+			dev.reserved += num_bytes;
+			dev.num_active++;
+			update_device(dev);
+		}
+		return index;
+	}
+
+	/*
+	 * Records that `num_bytes` of an active reservation were taken from free space already, ie. by preallocation.
+	 * With `is_counted` they are missing from `available` already (ie. a partial file which is resumed).
+	 */
+	void allocate(const size_t index, const uint64_t num_bytes, const bool is_counted = false)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto& drive = drives.at(index);
+		drive.allocated += num_bytes;
+		if(!is_counted) {
+			drive.available -= std::min(drive.available, num_bytes);
+		}
+	}
+
+	/*
+	 * Releases a reservation, of which `num_allocated` bytes were passed to allocate() before.
+	 * If `is_written` the rest of the bytes are now taken from free space.
+	 */
+	void release(const size_t index, const uint64_t num_bytes, const bool is_written, const uint64_t num_allocated = 0)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		update_active_time();
+		auto& drive = drives.at(index);
+		drive.reserved -= num_bytes;
+		drive.allocated -= std::min(drive.allocated, num_allocated);
+		drive.num_active--;
+		if(is_written) {
+			drive.available -= std::min(drive.available, num_bytes - std::min(num_bytes, num_allocated));
+		}
+		auto& dev = devices[drive.device];
+		dev.reserved -= num_bytes;
+		dev.num_active--;
+		update_device(dev);
+	}
+
+	/*
+	 * Returns the time integral of active copies on the drive's device, to be passed to add_result() when the copy finished.
+	 */
+	double get_active_time(const size_t index)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		update_active_time();
+		return devices[drives.at(index).device].active_time;
+	}
+
+	/*
+	 * Records a successful copy, for throughput based placement and parallelism tuning.
+	 * Throughput is tracked as an exponentially weighted moving average, so it follows drives slowing down as they fill up.
+	 * Returns true if the limit of parallel copies changed.
+	 */
+	bool add_result(const size_t index, const uint64_t num_bytes, const double elapsed_sec, const double active_time_begin)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		update_active_time();
+		auto& drive = drives.at(index);
+		drive.num_jobs++;
+		drive.num_bytes += num_bytes;
+		drive.total_sec += elapsed_sec;
+		if(elapsed_sec > 0) {
+			const auto sample = num_bytes / elapsed_sec;
+			drive.throughput = drive.throughput > 0 ? ewma_weight * sample + (1 - ewma_weight) * drive.throughput : sample;
+
+			auto& dev = devices[drive.device];
+			if(dev.tuner && dev.tuner->add_sample((dev.active_time - active_time_begin) / elapsed_sec, sample)) {
+				dev.max_active = dev.tuner->get_limit();
+				update_device(dev);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 * Adds a new drive, or brings back a removed one. Returns its index.
+	 */
+	size_t add(const std::string& path)
+	{
+		const auto info = group_devices ? provider->get_device(path) : block_device_t();
+		size_t index = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			bool is_known = false;
+			for(auto& drive : drives) {
+				if(drive.path == path) {
+					drive.is_removed = false;
+					index = drive.index;
+					is_known = true;
+				}
+			}
+			if(!is_known) {
+				index = add_drive_unlocked(path, &info);
+			}
+		}
+		refresh();		// free space of a returning drive may have changed as well
+		return index;
+	}
+
+	/*
+	 * No new copies will be placed on the drive, active copies finish normally.
+	 */
+	void remove(const size_t index)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		drives.at(index).is_removed = true;
+	}
+
+	void set_failed(const size_t index)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		drives.at(index).is_failed = true;
+	}
+
+	/*
+	 * Queries free space and disable markers of all drives, without holding the lock while doing so.
+	 */
+	void refresh()
+	{
+		std::vector<std::string> paths;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for(const auto& drive : drives) {
+				paths.push_back(drive.path);
+			}
+		}
+		std::vector<drive_status_t> list;
+		for(const auto& path : paths) {
+			list.push_back(provider->get_status(path));
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for(size_t i = 0; i < list.size(); ++i) {
+				auto& drive = drives[i];
+				drive.available = list[i].available;
+				drive.is_valid = list[i].is_valid;
+				drive.is_disabled = list[i].is_disabled;
+			}
+		}
+		if(on_refresh) {
+			on_refresh();
+		}
+	}
+
+private:
+	size_t add_drive_unlocked(const std::string& path, const block_device_t* info_ = nullptr)
+	{
+		drive_t drive;
+		drive.index = drives.size();
+		drive.path = path;
+		if(group_devices) {
+			const auto info = info_ ? *info_ : provider->get_device(path);
+			drive.device_name = info.name;
+			drive.controller = info.controller;
+		} else {
+			drive.device_name = path;
+		}
+		drive.device = devices.size();
+		for(const auto& dev : devices) {
+			if(dev.name == drive.device_name) {
+				drive.device = dev.index;
+			}
+		}
+		if(drive.device == devices.size()) {
+			device_t dev;
+			dev.index = devices.size();
+			dev.name = drive.device_name;
+			dev.max_active = max_num_active;
+			if(adaptive) {
+				dev.tuner = std::make_shared<ParallelTuner>(max_num_active);
+				dev.max_active = dev.tuner->get_limit();
+			}
+			devices.push_back(dev);
+		}
+		const auto& dev = devices[drive.device];
+		drive.device_active = dev.num_active;
+		drive.device_reserved = dev.reserved;
+		drive.max_active = dev.max_active;
+		drives.push_back(drive);
+		return drive.index;
+	}
+
+	struct device_t {
+		size_t index = 0;
+		std::string name;
+		uint64_t reserved = 0;
+		int64_t num_active = 0;
+		int max_active = -1;
+		double active_time = 0;			// integral of num_active over time [sec]
+		std::shared_ptr<ParallelTuner> tuner;
+	};
+
+	// copy device state into its drives, for select()
+	void update_device(const device_t& dev)
+	{
+		for(auto& drive : drives) {
+			if(drive.device == dev.index) {
+				drive.device_active = dev.num_active;
+				drive.device_reserved = dev.reserved;
+				drive.max_active = dev.max_active;
+			}
+		}
+	}
+
+	void update_active_time()
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const auto delta = std::chrono::duration<double>(now - time_last).count();
+		for(auto& dev : devices) {
+			dev.active_time += dev.num_active * delta;
+		}
+		time_last = now;
+	}
+
+	void refresh_loop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(do_run) {
+			signal.wait_for(lock, std::chrono::seconds(refresh_sec));
+			if(do_run) {
+				lock.unlock();
+				refresh();
+				lock.lock();
+			}
+		}
+	}
+
+private:
+	const int max_num_active;
+	const bool adaptive;
+	const bool group_devices;
+	const int refresh_sec;
+	const std::function<void()> on_refresh;
+	const std::shared_ptr<DriveProvider> provider;
+
+	mutable std::mutex mutex;
+	std::condition_variable signal;
+	std::thread thread;
+	bool do_run = true;
+	uint64_t select_counter = 0;
+	std::vector<drive_t> drives;
+	std::vector<device_t> devices;
+	std::chrono::steady_clock::time_point time_last;
+
+};
+
+
+#endif // INCLUDE_DRIVE_REGISTRY_HPP_
@@ -0,0 +1,155 @@
+/*
+ * drive_writer.hpp
+ */
+
+#ifndef INCLUDE_DRIVE_WRITER_HPP_
+#define INCLUDE_DRIVE_WRITER_HPP_
+
+#include <file_writer.hpp>
+#include <buffer_ring.hpp>
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <functional>
+#include <condition_variable>
+
+
+/*
+ * One writer thread per drive, accepting buffers from any number of copies.
+ * At most `queue_depth` writes are queued, write() blocks when full.
+ * To keep the disk head streaming, up to `max_batch` consecutive buffers of the same file are written
+ * before switching to the next file in FIFO order.
+ */
+class DriveWriter {
+public:
+	typedef std::function<void(const std::string& error, double write_sec)> callback_t;
+
+	DriveWriter(const size_t queue_depth, const size_t max_batch = 16)
+		:	queue_depth(std::max<size_t>(queue_depth, 1)),
+			max_batch(std::max<size_t>(max_batch, 1))
+	{
+		thread = std::thread(&DriveWriter::write_loop, this);
+	}
+
+	DriveWriter(const DriveWriter&) = delete;
+	DriveWriter& operator=(const DriveWriter&) = delete;
+
+	~DriveWriter()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			do_run = false;
+		}
+		signal.notify_all();
+		thread.join();
+	}
+
+	/*
+	 * Queues `buf` to be written to `file`, `callback` is called from the writer thread once done,
+	 * with the time spent in the write itself.
+	 */
+	void write(FileWriter* file, const buffer_t& buf, const callback_t& callback)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while(queue.size() >= queue_depth) {
+				signal.wait(lock);
+			}
+			request_t req;
+			req.file = file;
+			req.buf = buf;
+			req.callback = callback;
+			queue.push_back(req);
+		}
+		signal.notify_all();
+	}
+
+	/*
+	 * Returns total time the writer was idle [sec].
+	 */
+	double get_idle_time() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return std::chrono::duration<double>(idle_time).count();
+	}
+
+	size_t get_queue_size() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return queue.size();
+	}
+
+private:
+	struct request_t {
+		FileWriter* file = nullptr;
+		buffer_t buf;
+		callback_t callback;
+	};
+
+	void write_loop()
+	{
+		FileWriter* last_file = nullptr;
+		size_t batch = 0;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true) {
+			if(queue.empty()) {
+				if(!do_run) {
+					break;
+				}
+				const auto time_begin = std::chrono::steady_clock::now();
+				while(do_run && queue.empty()) {
+					signal.wait(lock);
+				}
+				idle_time += std::chrono::steady_clock::now() - time_begin;
+				continue;
+			}
+			auto iter = queue.begin();
+			if(batch < max_batch) {
+				for(auto it = queue.begin(); it != queue.end(); ++it) {
+					if(it->file == last_file) {
+						iter = it;
+						break;
+					}
+				}
+			}
+			if(iter->file != last_file) {
+				last_file = iter->file;
+				batch = 0;
+			}
+			batch++;
+
+			const auto req = *iter;
+			queue.erase(iter);
+			lock.unlock();
+			signal.notify_all();
+
+			std::string error;
+			const auto time_write = std::chrono::steady_clock::now();
+			try {
+				req.file->write(req.buf.data, req.buf.size);
+			} catch(const std::exception& ex) {
+				error = ex.what();
+			}
+			req.callback(error, std::chrono::duration<double>(std::chrono::steady_clock::now() - time_write).count());
+
+			lock.lock();
+		}
+	}
+
+private:
+	const size_t queue_depth;
+	const size_t max_batch;
+
+	mutable std::mutex mutex;
+	std::condition_variable signal;
+	std::thread thread;
+	bool do_run = true;
+	std::deque<request_t> queue;
+	std::chrono::steady_clock::duration idle_time = {};
+
+};
+
+
+#endif // INCLUDE_DRIVE_WRITER_HPP_
@@ -0,0 +1,452 @@
+/*
+ * file_writer.hpp
+ */
+
+#ifndef INCLUDE_FILE_WRITER_HPP_
+#define INCLUDE_FILE_WRITER_HPP_
+
+#include <stdiox.hpp>
+#include <rate_limiter.hpp>
+
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <stdlib.h>
+#endif
+
+
+/*
+ * Reserves space for the whole file up front, to avoid fragmentation and to fail early on ENOSPC.
+ * Returns false if not supported by the file system, throws on other errors.
+ */
+inline
+bool preallocate_file(const int fd, const uint64_t num_bytes, const std::string& file_path)
+{
+	if(!num_bytes) {
+		return true;
+	}
+#if defined(__linux__)
+	// use fallocate() directly, posix_fallocate() would emulate it by writing every block
+	if(::fallocate(fd, 0, 0, num_bytes) == 0) {
+		return true;
+	}
+	const int err = errno;
+#elif !defined(_WIN32)
+	const int err = ::posix_fallocate(fd, 0, num_bytes);
+	if(err == 0) {
+		return true;
+	}
+#else
+	const int err = EOPNOTSUPP;
+#endif
+	if(err == EOPNOTSUPP || err == ENOSYS || err == EINVAL) {
+		return false;
+	}
+	throw std::runtime_error("fallocate('" + file_path + "') failed with: " + std::string(strerror(err)));
+}
+
+
+class FileWriter {
+public:
+	virtual ~FileWriter() {}
+
+	/*
+	 * Writes all data or throws.
+	 */
+	virtual void write(const void* data, const size_t num_bytes) = 0;
+
+	/*
+	 * Flushes all data and closes the file, throws on failure.
+	 */
+	virtual void close() = 0;
+
+	/*
+	 * See preallocate_file().
+	 */
+	virtual bool preallocate(const uint64_t num_bytes) = 0;
+
+	/*
+	 * Returns file descriptor for direct kernel access (ie. splice), or -1 if not supported.
+	 */
+	virtual int get_fd() const {
+		return -1;
+	}
+
+	virtual std::string get_mode() const = 0;
+
+};
+
+
+class BufferedWriter : public FileWriter {
+public:
+	/*
+	 * A non-zero `offset` keeps the existing file and continues writing at `offset`.
+	 */
+	BufferedWriter(const std::string& file_path, const uint64_t offset = 0)
+		:	file_path(file_path)
+	{
+		file = fopen(file_path.c_str(), offset ? "r+b" : "wb");
+		if(!file) {
+			throw std::runtime_error("fopen('" + file_path + "') failed with: " + std::string(strerror(errno)));
+		}
+		if(offset && FSEEK(file, offset, SEEK_SET)) {
+			const int err = errno;
+			fclose(file);
+			throw std::runtime_error("fseek('" + file_path + "') failed with: " + std::string(strerror(err)));
+		}
+	}
+
+	~BufferedWriter() {
+		if(file) {
+			fclose(file);
+		}
+	}
+
+	void write(const void* data, const size_t num_bytes) override {
+		if(fwrite(data, 1, num_bytes, file) != num_bytes) {
+			throw std::runtime_error("fwrite('" + file_path + "') failed with: " + std::string(strerror(errno)));
+		}
+	}
+
+	void close() override {
+		auto* tmp = file;
+		file = nullptr;
+		if(tmp && fclose(tmp)) {
+			throw std::runtime_error("fclose('" + file_path + "') failed with: " + std::string(strerror(errno)));
+		}
+	}
+
+	bool preallocate(const uint64_t num_bytes) override {
+		return preallocate_file(::fileno(file), num_bytes, file_path);
+	}
+
+	int get_fd() const override {
+		return file ? ::fileno(file) : -1;
+	}
+
+	std::string get_mode() const override {
+		return "buffered";
+	}
+
+private:
+	const std::string file_path;
+	FILE* file = nullptr;
+
+};
+
+
+/*
+ * Passes writes through to another writer, after waiting for `limiter`.
+ * Does not expose a file descriptor, so splice() cannot bypass the limit.
+ */
+class ThrottledWriter : public FileWriter {
+public:
+	ThrottledWriter(std::shared_ptr<FileWriter> file, std::shared_ptr<RateLimiter> limiter)
+		:	file(file), limiter(limiter)
+	{
+	}
+
+	void write(const void* data, const size_t num_bytes) override {
+		limiter->acquire(num_bytes);
+		file->write(data, num_bytes);
+	}
+
+	void close() override {
+		file->close();
+	}
+
+	bool preallocate(const uint64_t num_bytes) override {
+		return file->preallocate(num_bytes);
+	}
+
+	std::string get_mode() const override {
+		return file->get_mode() + ", throttled";
+	}
+
+private:
+	std::shared_ptr<FileWriter> file;
+	std::shared_ptr<RateLimiter> limiter;
+
+};
+
+
+#ifndef _WIN32
+
+/*
+ * Writes one byte range of a file shared with other writers, via pwrite() starting at `offset`.
+ * The file descriptor is owned by the caller, close() only checks for errors.
+ */
+class RangeWriter : public FileWriter {
+public:
+	RangeWriter(const int fd, const uint64_t offset, const std::string& file_path)
+		:	fd(fd), offset(offset), file_path(file_path)
+	{
+	}
+
+	void write(const void* data, const size_t num_bytes) override
+	{
+		auto* src = (const char*)data;
+		size_t num_left = num_bytes;
+		while(num_left) {
+			const auto ret = ::pwrite(fd, src, num_left, offset);
+			if(ret < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				throw std::runtime_error("pwrite('" + file_path + "') failed with: " + std::string(strerror(errno)));
+			}
+			src += ret;
+			offset += ret;
+			num_left -= ret;
+		}
+	}
+
+	void close() override {
+	}
+
+	bool preallocate(const uint64_t num_bytes) override {
+		return preallocate_file(fd, num_bytes, file_path);
+	}
+
+	std::string get_mode() const override {
+		return "striped";
+	}
+
+private:
+	const int fd;
+	uint64_t offset = 0;
+	const std::string file_path;
+
+};
+
+#endif // _WIN32
+
+
+#ifdef __linux__
+
+/*
+ * Writes via O_DIRECT, bypassing the page cache.
+ * Data is collected in two aligned buffers, one is being filled while the other is written in the background.
+ * The unaligned tail is padded to the next block and the file truncated to its real size on close().
+ * A non-zero `offset` (multiple of `alignment`) keeps the existing file and continues writing at `offset`.
+ */
+class DirectWriter : public FileWriter {
+public:
+	static constexpr size_t alignment = 4096;
+
+	DirectWriter(const std::string& file_path, const size_t buffer_size = 4 * 1024 * 1024, const uint64_t offset = 0)
+		:	file_path(file_path),
+			buffer_size(((buffer_size + alignment - 1) / alignment) * alignment)
+	{
+		open_at(offset);
+		for(auto& buf : buffer) {
+			if(posix_memalign((void**)&buf, alignment, this->buffer_size)) {
+				free_buffers();
+				::close(fd);
+				throw std::runtime_error("posix_memalign() failed");
+			}
+		}
+		thread = std::thread(&DirectWriter::write_loop, this);
+	}
+
+	/*
+	 * Uses two external buffers of `buffer_size` bytes each, which must be aligned.
+	 */
+	DirectWriter(const std::string& file_path, char* buffer_0, char* buffer_1, const size_t buffer_size, const uint64_t offset = 0)
+		:	file_path(file_path),
+			buffer_size(buffer_size),
+			is_external(true)
+	{
+		if(buffer_size % alignment || (size_t(buffer_0) | size_t(buffer_1)) % alignment) {
+			throw std::logic_error("DirectWriter: buffers not aligned");
+		}
+		open_at(offset);
+		buffer[0] = buffer_0;
+		buffer[1] = buffer_1;
+		thread = std::thread(&DirectWriter::write_loop, this);
+	}
+
+	~DirectWriter() {
+		stop();
+		if(fd >= 0) {
+			::close(fd);
+		}
+		free_buffers();
+	}
+
+	void write(const void* data, const size_t num_bytes) override
+	{
+		auto* src = (const char*)data;
+		auto left = num_bytes;
+		while(left) {
+			const auto count = std::min(left, buffer_size - offset);
+			::memcpy(buffer[index] + offset, src, count);
+			offset += count;
+			src += count;
+			left -= count;
+			if(offset == buffer_size) {
+				flush(offset);
+			}
+		}
+	}
+
+	void close() override
+	{
+		const auto total_bytes = file_offset + offset;
+		if(offset) {
+			const auto padded = ((offset + alignment - 1) / alignment) * alignment;
+			::memset(buffer[index] + offset, 0, padded - offset);
+			flush(padded);
+		}
+		wait();
+		stop();
+		if(::ftruncate(fd, total_bytes)) {
+			throw std::runtime_error("ftruncate('" + file_path + "') failed with: " + std::string(strerror(errno)));
+		}
+		const auto tmp = fd;
+		fd = -1;
+		if(::close(tmp)) {
+			throw std::runtime_error("close('" + file_path + "') failed with: " + std::string(strerror(errno)));
+		}
+	}
+
+	bool preallocate(const uint64_t num_bytes) override {
+		return preallocate_file(fd, num_bytes, file_path);
+	}
+
+	std::string get_mode() const override {
+		return "direct";
+	}
+
+private:
+	void open_at(const uint64_t offset)
+	{
+		if(offset % alignment) {
+			throw std::logic_error("DirectWriter: offset not aligned");
+		}
+		fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC) | O_DIRECT, 0644);
+		if(fd < 0) {
+			throw std::runtime_error("open('" + file_path + "', O_DIRECT) failed with: " + std::string(strerror(errno)));
+		}
+		file_offset = offset;
+	}
+
+	// hand current buffer to background thread, after previous write has finished
+	void flush(const size_t num_bytes)
+	{
+		wait();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending_index = index;
+			pending_bytes = num_bytes;
+			pending_offset = file_offset;
+		}
+		signal.notify_all();
+
+		file_offset += num_bytes;
+		index = (index + 1) % 2;
+		offset = 0;
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(pending_bytes) {
+			signal.wait(lock);
+		}
+		if(!error.empty()) {
+			throw std::runtime_error(error);
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			do_run = false;
+		}
+		signal.notify_all();
+		if(thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	void write_loop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true) {
+			while(do_run && !pending_bytes) {
+				signal.wait(lock);
+			}
+			if(!pending_bytes) {
+				break;
+			}
+			const auto* src = buffer[pending_index];
+			const auto num_bytes = pending_bytes;
+			const auto dst_offset = pending_offset;
+			lock.unlock();
+
+			std::string error_;
+			size_t total = 0;
+			while(total < num_bytes) {
+				const auto ret = ::pwrite(fd, src + total, num_bytes - total, dst_offset + total);
+				if(ret <= 0) {
+					if(ret < 0 && errno == EINTR) {
+						continue;
+					}
+					error_ = "pwrite('" + file_path + "') failed with: " + std::string(ret < 0 ? strerror(errno) : "EOF");
+					break;
+				}
+				total += ret;
+			}
+			lock.lock();
+			if(error.empty()) {
+				error = error_;
+			}
+			pending_bytes = 0;
+			signal.notify_all();
+		}
+	}
+
+	void free_buffers() {
+		for(auto& buf : buffer) {
+			if(!is_external) {
+				free(buf);
+			}
+			buf = nullptr;
+		}
+	}
+
+private:
+	const std::string file_path;
+	const size_t buffer_size;
+	const bool is_external = false;
+
+	int fd = -1;
+	char* buffer[2] = {};
+	size_t index = 0;
+	size_t offset = 0;
+	uint64_t file_offset = 0;
+
+	std::mutex mutex;
+	std::condition_variable signal;
+	std::thread thread;
+	bool do_run = true;
+	size_t pending_index = 0;
+	size_t pending_bytes = 0;
+	uint64_t pending_offset = 0;
+	std::string error;
+
+};
+
+#endif // __linux__
+
+
+#endif // INCLUDE_FILE_WRITER_HPP_
@@ -0,0 +1,185 @@
+/*
+ * io_uring.hpp
+ */
+
+#ifndef INCLUDE_IO_URING_HPP_
+#define INCLUDE_IO_URING_HPP_
+
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls (no liburing dependency).
+ * Not thread safe, each event loop owns its own ring.
+ */
+class IoUring {
+public:
+	IoUring(const unsigned num_entries)
+	{
+		::io_uring_params params;
+		::memset(&params, 0, sizeof(params));
+
+		fd = ::syscall(__NR_io_uring_setup, num_entries, &params);
+		if(fd < 0) {
+			throw std::runtime_error("io_uring_setup() failed with: " + std::string(strerror(errno)));
+		}
+		try {
+			init(params);
+		} catch(...) {
+			cleanup();
+			throw;
+		}
+	}
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	~IoUring() {
+		cleanup();
+	}
+
+	/*
+	 * Returns a cleared SQE, or nullptr if the submission queue is full.
+	 */
+	::io_uring_sqe* get_sqe()
+	{
+		if(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+			return nullptr;
+		}
+		auto* sqe = &sqes[sqe_tail & sq_mask];
+		::memset(sqe, 0, sizeof(::io_uring_sqe));
+		sqe_tail++;
+		return sqe;
+	}
+
+	unsigned get_space() const {
+		return sq_entries - (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+	}
+
+	/*
+	 * Submits all queued SQEs and waits for at least `wait_nr` completions.
+	 */
+	int submit(const unsigned wait_nr = 0)
+	{
+		__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+		const unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+		while(true) {
+			const auto ret = ::syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+			if(ret < 0) {
+				if(errno == EINTR) {
+					if(wait_nr && !to_submit) {
+						continue;
+					}
+					return 0;
+				}
+				throw std::runtime_error("io_uring_enter() failed with: " + std::string(strerror(errno)));
+			}
+			return ret;
+		}
+	}
+
+	/*
+	 * Returns the next completion, or nullptr if there is none. Must be followed by cqe_seen().
+	 */
+	::io_uring_cqe* peek_cqe()
+	{
+		const auto head = *cq_head;
+		if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			return nullptr;
+		}
+		return &cqes[head & cq_mask];
+	}
+
+	void cqe_seen() {
+		__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+	}
+
+private:
+	void init(const ::io_uring_params& params)
+	{
+		sq_entries = params.sq_entries;
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(::io_uring_cqe);
+
+		const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if(single_mmap) {
+			sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+		}
+		sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+		cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+		sqes = (::io_uring_sqe*)map(params.sq_entries * sizeof(::io_uring_sqe), IORING_OFF_SQES);
+
+		sq_head = (unsigned*)((char*)sq_ring + params.sq_off.head);
+		sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+		sq_mask = *(unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+		cq_head = (unsigned*)((char*)cq_ring + params.cq_off.head);
+		cq_tail = (unsigned*)((char*)cq_ring + params.cq_off.tail);
+		cq_mask = *(unsigned*)((char*)cq_ring + params.cq_off.ring_mask);
+		cqes = (::io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+
+		// SQEs are always used in ring order, so the index array is static
+		auto* sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+		for(unsigned i = 0; i < sq_entries; ++i) {
+			sq_array[i] = i;
+		}
+		sqe_tail = *sq_tail;
+	}
+
+	void cleanup()
+	{
+		if(sqes) {
+			::munmap(sqes, sq_entries * sizeof(::io_uring_sqe));
+		}
+		if(cq_ring && cq_ring != sq_ring) {
+			::munmap(cq_ring, cq_ring_size);
+		}
+		if(sq_ring) {
+			::munmap(sq_ring, sq_ring_size);
+		}
+		if(fd >= 0) {
+			::close(fd);
+		}
+	}
+
+	void* map(const size_t size, const off_t offset)
+	{
+		auto* ptr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		if(ptr == MAP_FAILED) {
+			throw std::runtime_error("mmap() failed for io_uring with: " + std::string(strerror(errno)));
+		}
+		return ptr;
+	}
+
+private:
+	int fd = -1;
+	unsigned sq_entries = 0;
+	size_t sq_ring_size = 0;
+	size_t cq_ring_size = 0;
+
+	void* sq_ring = nullptr;
+	void* cq_ring = nullptr;
+	::io_uring_sqe* sqes = nullptr;
+	::io_uring_cqe* cqes = nullptr;
+
+	unsigned* sq_head = nullptr;
+	unsigned* sq_tail = nullptr;
+	unsigned sq_mask = 0;
+	unsigned sqe_tail = 0;
+
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	unsigned cq_mask = 0;
+
+};
+
+
+#endif // INCLUDE_IO_URING_HPP_
@@ -0,0 +1,274 @@
+/*
+ * metrics.hpp
+ */
+
+#ifndef INCLUDE_METRICS_HPP_
+#define INCLUDE_METRICS_HPP_
+
+#include <stdiox.hpp>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+#ifdef _WIN32
+#define METRICS_POLL WSAPoll
+#else
+#include <poll.h>
+#include <arpa/inet.h>
+#define METRICS_POLL ::poll
+#endif
+
+
+/*
+ * Monotonic counter, safe to update from any thread without locking.
+ */
+class Counter {
+public:
+	void add(const uint64_t value = 1) {
+		count.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	uint64_t get() const {
+		return count.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> count {0};
+};
+
+
+class Gauge {
+public:
+	void set(const int64_t value_) {
+		value.store(value_, std::memory_order_relaxed);
+	}
+
+	void add(const int64_t delta) {
+		value.fetch_add(delta, std::memory_order_relaxed);
+	}
+
+	int64_t get() const {
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<int64_t> value {0};
+};
+
+
+/*
+ * Histogram with fixed bucket bounds, observe() is lock-free.
+ * The sum is kept in micro units, to avoid floating point atomics.
+ */
+class Histogram {
+public:
+	Histogram(const std::vector<double>& bounds)
+		:	bounds(bounds),
+			buckets(bounds.size() + 1)
+	{
+	}
+
+	void observe(const double value)
+	{
+		const auto index = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+		buckets[index].fetch_add(1, std::memory_order_relaxed);
+		sum_micro.fetch_add(uint64_t(std::max(value, 0.) * 1e6), std::memory_order_relaxed);
+	}
+
+	uint64_t get_count() const {
+		uint64_t total = 0;
+		for(const auto& entry : buckets) {
+			total += entry.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+	double get_sum() const {
+		return sum_micro.load(std::memory_order_relaxed) / 1e6;
+	}
+
+	/*
+	 * Returns the upper bound of the bucket containing quantile `q`, approximately.
+	 */
+	double get_quantile(const double q) const
+	{
+		const auto total = get_count();
+		uint64_t sum = 0;
+		for(size_t i = 0; i < bounds.size(); ++i) {
+			sum += buckets[i].load(std::memory_order_relaxed);
+			if(total && sum >= q * total) {
+				return bounds[i];
+			}
+		}
+		return bounds.empty() ? 0 : bounds.back();
+	}
+
+	/*
+	 * Writes buckets in Prometheus text format, `labels` without braces (ie. 'drive="/mnt/disk0"').
+	 */
+	void write(std::ostream& out, const std::string& name, const std::string& labels = "") const
+	{
+		const auto prefix = labels.empty() ? std::string() : labels + ",";
+		uint64_t sum = 0;
+		for(size_t i = 0; i <= bounds.size(); ++i) {
+			sum += buckets[i].load(std::memory_order_relaxed);
+			out << name << "_bucket{" << prefix << "le=\"";
+			if(i < bounds.size()) {
+				out << bounds[i];
+			} else {
+				out << "+Inf";
+			}
+			out << "\"} " << sum << "\n";
+		}
+		const auto braces = labels.empty() ? std::string() : "{" + labels + "}";
+		out << name << "_sum" << braces << " " << get_sum() << "\n";
+		out << name << "_count" << braces << " " << sum << "\n";
+	}
+
+private:
+	const std::vector<double> bounds;
+	std::vector<std::atomic<uint64_t>> buckets;
+	std::atomic<uint64_t> sum_micro {0};
+};
+
+
+inline
+void write_metric_header(std::ostream& out, const std::string& name, const std::string& type, const std::string& help)
+{
+	out << "# HELP " << name << " " << help << "\n";
+	out << "# TYPE " << name << " " << type << "\n";
+}
+
+inline
+std::string escape_label(const std::string& value)
+{
+	std::string out;
+	for(const auto c : value) {
+		if(c == '\\' || c == '"') {
+			out += '\\';
+			out += c;
+		} else if(c == '\n') {
+			out += "\\n";
+		} else {
+			out += c;
+		}
+	}
+	return out;
+}
+
+
+/*
+ * Minimal HTTP server for scraping, serves the output of `render` on GET /metrics.
+ * Runs in its own thread and handles one request at a time, so it cannot slow down anything else.
+ */
+class MetricsServer {
+public:
+	MetricsServer(const ::sockaddr_in& addr, const std::function<std::string()>& render)
+		:	render(render)
+	{
+		server = ::socket(AF_INET, SOCK_STREAM, 0);
+		if(server < 0) {
+			throw std::runtime_error("socket() failed for metrics server");
+		}
+		int enable = 1;
+		::setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&enable, sizeof(enable));
+
+		if(::bind(server, (const ::sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(server, 16) < 0) {
+			CLOSESOCKET(server);
+			throw std::runtime_error("bind() failed for metrics server on port " + std::to_string(ntohs(addr.sin_port)));
+		}
+		thread = std::thread(&MetricsServer::serve_loop, this);
+	}
+
+	MetricsServer(const MetricsServer&) = delete;
+	MetricsServer& operator=(const MetricsServer&) = delete;
+
+	~MetricsServer()
+	{
+		do_run = false;
+		thread.join();
+		CLOSESOCKET(server);
+	}
+
+private:
+	void serve_loop()
+	{
+		while(do_run) {
+			::pollfd entry = {};
+			entry.fd = server;
+			entry.events = POLLIN;
+			if(METRICS_POLL(&entry, 1, 500) <= 0) {
+				continue;
+			}
+			const int fd = ::accept(server, 0, 0);
+			if(fd < 0) {
+				continue;
+			}
+			try {
+				handle(fd);
+			} catch(...) {
+				// ignore
+			}
+			CLOSESOCKET(fd);
+		}
+	}
+
+	void handle(const int fd)
+	{
+		// read request header, with timeout
+		std::string request;
+		while(request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+			::pollfd entry = {};
+			entry.fd = fd;
+			entry.events = POLLIN;
+			if(METRICS_POLL(&entry, 1, 1000) <= 0) {
+				return;
+			}
+			char buf[1024];
+			const auto num_read = ::recv(fd, buf, sizeof(buf), 0);
+			if(num_read <= 0) {
+				return;
+			}
+			request.append(buf, num_read);
+		}
+		std::string status = "200 OK";
+		std::string body;
+		if(request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+			body = render();
+		} else {
+			status = "404 Not Found";
+		}
+		std::ostringstream out;
+		out << "HTTP/1.1 " << status << "\r\n"
+			<< "Content-Type: text/plain; version=0.0.4\r\n"
+			<< "Content-Length: " << body.size() << "\r\n"
+			<< "Connection: close\r\n\r\n" << body;
+		const auto response = out.str();
+		size_t offset = 0;
+		while(offset < response.size()) {
+			const auto num_sent = ::send(fd, response.data() + offset, response.size() - offset, 0);
+			if(num_sent <= 0) {
+				return;
+			}
+			offset += num_sent;
+		}
+	}
+
+private:
+	const std::function<std::string()> render;
+	int server = -1;
+	std::atomic<bool> do_run {true};
+	std::thread thread;
+
+};
+
+
+#endif // INCLUDE_METRICS_HPP_
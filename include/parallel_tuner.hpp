@@ -0,0 +1,79 @@
+/*
+ * parallel_tuner.hpp
+ */
+
+#ifndef INCLUDE_PARALLEL_TUNER_HPP_
+#define INCLUDE_PARALLEL_TUNER_HPP_
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+
+/*
+ * Finds the number of parallel copies which maximizes the total write throughput of one drive, by hill climbing.
+ * The limit is raised as long as one more copy still increases total throughput by at least `min_gain`,
+ * and lowered again if it does not (ie. HDDs thrashing between streams).
+ * Every `probe_interval` samples the next higher limit is tried again, in case conditions changed.
+ */
+class ParallelTuner {
+public:
+	ParallelTuner(const int max_limit, const size_t min_samples = 2, const double min_gain = 0.05, const size_t probe_interval = 20)
+		:	max_limit(std::max(max_limit, 1)),
+			min_samples(std::max<size_t>(min_samples, 1)),
+			min_gain(min_gain),
+			probe_interval(probe_interval),
+			speed(this->max_limit + 2),
+			count(this->max_limit + 2)
+	{
+	}
+
+	int get_limit() const {
+		return limit;
+	}
+
+	/*
+	 * Adds one finished copy, with the average number of parallel copies while it ran and its own throughput.
+	 * Returns true if the limit changed.
+	 */
+	bool add_sample(const double concurrency, const double throughput)
+	{
+		const int level = std::min(std::max(int(std::lround(concurrency)), 1), max_limit);
+		const auto total = throughput * std::max(concurrency, 1.);
+		speed[level] = count[level] ? weight * total + (1 - weight) * speed[level] : total;
+		count[level]++;
+
+		if(++num_samples % probe_interval == 0 && limit < max_limit) {
+			count[limit + 1] = 0;		// forget, to probe again
+		}
+		if(count[limit] < min_samples) {
+			return false;
+		}
+		if(limit > 1 && count[limit - 1] && speed[limit] < speed[limit - 1] * (1 + min_gain)) {
+			limit--;
+		} else if(limit < max_limit && (!count[limit + 1] || speed[limit + 1] > speed[limit] * (1 + min_gain))) {
+			limit++;
+		} else {
+			return false;
+		}
+		count[limit] = std::min(count[limit], min_samples - 1);		// need fresh samples at new limit
+		return true;
+	}
+
+private:
+	static constexpr double weight = 0.5;
+
+	const int max_limit;
+	const size_t min_samples;
+	const double min_gain;
+	const size_t probe_interval;
+
+	int limit = 1;
+	size_t num_samples = 0;
+	std::vector<double> speed;			// moving average of total throughput per level
+	std::vector<size_t> count;			// number of samples per level
+
+};
+
+
+#endif // INCLUDE_PARALLEL_TUNER_HPP_
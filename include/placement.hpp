@@ -0,0 +1,237 @@
+/*
+ * placement.hpp
+ */
+
+#ifndef INCLUDE_PLACEMENT_HPP_
+#define INCLUDE_PLACEMENT_HPP_
+
+#include <drive_registry.hpp>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+
+/*
+ * Decides which drive receives the next file.
+ * select() is called with the current drive table and returns a drive index, or -1 if none can take the file.
+ */
+class PlacementPolicy {
+public:
+	virtual ~PlacementPolicy() {}
+
+	virtual int select(const std::vector<drive_t>& drives, const uint64_t num_bytes) = 0;
+
+	virtual std::string get_name() const = 0;
+
+protected:
+	/*
+	 * Returns drives which can take the file right now, in table order.
+	 */
+	std::vector<const drive_t*> get_candidates(const std::vector<drive_t>& drives, const uint64_t num_bytes) const
+	{
+		std::vector<const drive_t*> out;
+		for(const auto& drive : drives) {
+			if(drive.can_fit(num_bytes) && drive.has_free_slot()) {
+				out.push_back(&drive);
+			}
+		}
+		return out;
+	}
+
+};
+
+
+/*
+ * Drives on idle devices with most free space first, then busy devices with the least active copies.
+ * Spreads write bandwidth over as many devices as possible.
+ */
+class MostFreePlacement : public PlacementPolicy {
+public:
+	int select(const std::vector<drive_t>& drives, const uint64_t num_bytes) override
+	{
+		auto list = get_candidates(drives, num_bytes);
+		std::stable_sort(list.begin(), list.end(),
+			[](const drive_t* L, const drive_t* R) -> bool {
+				if(bool(L->device_active) != bool(R->device_active)) {
+					return !L->device_active;
+				}
+				if(!L->device_active) {
+					return L->available > R->available;
+				}
+				return L->device_active < R->device_active;
+			});
+		return list.empty() ? -1 : list[0]->index;
+	}
+
+	std::string get_name() const override {
+		return "most-free";
+	}
+};
+
+
+/*
+ * Cycles through the drives in order, skipping those which cannot take the file.
+ */
+class RoundRobinPlacement : public PlacementPolicy {
+public:
+	int select(const std::vector<drive_t>& drives, const uint64_t num_bytes) override
+	{
+		const auto list = get_candidates(drives, num_bytes);
+		if(list.empty()) {
+			return -1;
+		}
+		const drive_t* out = list[0];
+		for(const auto* drive : list) {
+			if(drive->index >= next) {
+				out = drive;
+				break;
+			}
+		}
+		next = out->index + 1;
+		return out->index;
+	}
+
+	std::string get_name() const override {
+		return "round-robin";
+	}
+
+private:
+	size_t next = 0;
+};
+
+
+/*
+ * Always the first drive in order which can take the file, to fill drives one at a time.
+ */
+class FillFirstPlacement : public PlacementPolicy {
+public:
+	int select(const std::vector<drive_t>& drives, const uint64_t num_bytes) override
+	{
+		const auto list = get_candidates(drives, num_bytes);
+		return list.empty() ? -1 : list[0]->index;
+	}
+
+	std::string get_name() const override {
+		return "fill-first";
+	}
+};
+
+
+/*
+ * The drive which was selected least recently, idle devices first.
+ */
+class LRUPlacement : public PlacementPolicy {
+public:
+	int select(const std::vector<drive_t>& drives, const uint64_t num_bytes) override
+	{
+		auto list = get_candidates(drives, num_bytes);
+		std::stable_sort(list.begin(), list.end(),
+			[](const drive_t* L, const drive_t* R) -> bool {
+				if(L->device_active != R->device_active) {
+					return L->device_active < R->device_active;
+				}
+				return L->last_select < R->last_select;
+			});
+		return list.empty() ? -1 : list[0]->index;
+	}
+
+	std::string get_name() const override {
+		return "lru";
+	}
+};
+
+
+/*
+ * Shares copies among drives in proportion to their measured write throughput,
+ * ie. the drive with the highest throughput per active copy on its device wins.
+ * Drives without measurement yet are assumed to be as fast as the fastest one, so they get tried.
+ */
+class ThroughputPlacement : public PlacementPolicy {
+public:
+	int select(const std::vector<drive_t>& drives, const uint64_t num_bytes) override
+	{
+		const auto list = get_candidates(drives, num_bytes);
+		double max_speed = 0;
+		for(const auto& drive : drives) {
+			max_speed = std::max(max_speed, drive.get_throughput());
+		}
+		const drive_t* out = nullptr;
+		double best = 0;
+		for(const auto* drive : list) {
+			const auto speed = drive->get_throughput();
+			const auto share = (speed > 0 ? speed : std::max(max_speed, 1.)) / (drive->device_active + 1);
+			if(!out || share > best) {
+				out = drive;
+				best = share;
+			}
+		}
+		return out ? out->index : -1;
+	}
+
+	std::string get_name() const override {
+		return "throughput";
+	}
+};
+
+
+/*
+ * The drive expected to finish the file soonest, given the bytes already queued on its device and its measured throughput.
+ * Drives without measurement yet are assumed to be as fast as the fastest one, ties go to the drive with most free space.
+ */
+class SoonestFinishPlacement : public PlacementPolicy {
+public:
+	int select(const std::vector<drive_t>& drives, const uint64_t num_bytes) override
+	{
+		const auto list = get_candidates(drives, num_bytes);
+		double max_speed = 0;
+		for(const auto& drive : drives) {
+			max_speed = std::max(max_speed, drive.get_throughput());
+		}
+		const drive_t* out = nullptr;
+		double best = 0;
+		for(const auto* drive : list) {
+			const auto speed = drive->get_throughput();
+			const auto eta = (drive->device_reserved + num_bytes) / (speed > 0 ? speed : std::max(max_speed, 1.));
+			if(!out || eta < best || (eta == best && drive->available > out->available)) {
+				out = drive;
+				best = eta;
+			}
+		}
+		return out ? out->index : -1;
+	}
+
+	std::string get_name() const override {
+		return "eta";
+	}
+};
+
+
+inline
+std::shared_ptr<PlacementPolicy> create_placement(const std::string& name)
+{
+	if(name == "most-free") {
+		return std::make_shared<MostFreePlacement>();
+	}
+	if(name == "round-robin") {
+		return std::make_shared<RoundRobinPlacement>();
+	}
+	if(name == "fill-first") {
+		return std::make_shared<FillFirstPlacement>();
+	}
+	if(name == "lru") {
+		return std::make_shared<LRUPlacement>();
+	}
+	if(name == "throughput") {
+		return std::make_shared<ThroughputPlacement>();
+	}
+	if(name == "eta") {
+		return std::make_shared<SoonestFinishPlacement>();
+	}
+	throw std::logic_error("invalid placement: " + name);
+}
+
+
+#endif // INCLUDE_PLACEMENT_HPP_
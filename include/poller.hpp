@@ -0,0 +1,148 @@
+/*
+ * poller.hpp
+ */
+
+#ifndef INCLUDE_POLLER_HPP_
+#define INCLUDE_POLLER_HPP_
+
+#include <stdiox.hpp>
+
+#include <map>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+
+/*
+ * Readiness notification for many sockets, epoll() on Linux and poll() / WSAPoll() elsewhere.
+ * Events are given as POLLIN / POLLOUT, returned events additionally contain POLLERR / POLLHUP.
+ */
+class Poller {
+public:
+	struct event_t {
+		int fd = -1;
+		int events = 0;
+	};
+
+	Poller()
+	{
+#ifdef __linux__
+		epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+		if(epoll_fd < 0) {
+			throw std::runtime_error("epoll_create1() failed with: " + std::string(strerror(errno)));
+		}
+#endif
+	}
+
+	Poller(const Poller&) = delete;
+	Poller& operator=(const Poller&) = delete;
+
+	~Poller()
+	{
+#ifdef __linux__
+		::close(epoll_fd);
+#endif
+	}
+
+	void add(const int fd, const int events)
+	{
+#ifdef __linux__
+		::epoll_event ev = {};
+		ev.events = to_epoll(events);
+		ev.data.fd = fd;
+		if(::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			throw std::runtime_error("epoll_ctl() failed with: " + std::string(strerror(errno)));
+		}
+#endif
+		fds[fd] = events;
+	}
+
+	void remove(const int fd)
+	{
+#ifdef __linux__
+		::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+		fds.erase(fd);
+	}
+
+	size_t size() const {
+		return fds.size();
+	}
+
+	/*
+	 * Waits up to `timeout_ms` for events, returns empty list on timeout or interrupt.
+	 */
+	std::vector<event_t> wait(const int timeout_ms)
+	{
+		std::vector<event_t> out;
+#ifdef __linux__
+		std::vector<::epoll_event> list(std::max<size_t>(fds.size(), 1));
+		const auto ret = ::epoll_wait(epoll_fd, list.data(), list.size(), timeout_ms);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				return out;
+			}
+			throw std::runtime_error("epoll_wait() failed with: " + std::string(strerror(errno)));
+		}
+		for(int i = 0; i < ret; ++i) {
+			event_t ev;
+			ev.fd = list[i].data.fd;
+			ev.events = from_epoll(list[i].events);
+			out.push_back(ev);
+		}
+#else
+		std::vector<::pollfd> list;
+		for(const auto& entry : fds) {
+			::pollfd pfd = {};
+			pfd.fd = entry.first;
+			pfd.events = entry.second;
+			list.push_back(pfd);
+		}
+#ifdef _WIN32
+		const auto ret = WSAPoll(list.data(), list.size(), timeout_ms);
+#else
+		const auto ret = ::poll(list.data(), list.size(), timeout_ms);
+#endif
+		if(ret < 0) {
+			if(errno == EINTR) {
+				return out;
+			}
+			throw std::runtime_error("poll() failed with: " + std::string(strerror(errno)));
+		}
+		for(const auto& pfd : list) {
+			if(pfd.revents) {
+				event_t ev;
+				ev.fd = pfd.fd;
+				ev.events = pfd.revents;
+				out.push_back(ev);
+			}
+		}
+#endif
+		return out;
+	}
+
+private:
+#ifdef __linux__
+	static uint32_t to_epoll(const int events) {
+		return ((events & POLLIN) ? uint32_t(EPOLLIN) : 0) | ((events & POLLOUT) ? uint32_t(EPOLLOUT) : 0) | EPOLLRDHUP;
+	}
+	static int from_epoll(const uint32_t events) {
+		return	((events & (EPOLLIN | EPOLLRDHUP)) ? POLLIN : 0) | ((events & EPOLLOUT) ? POLLOUT : 0)
+			|	((events & EPOLLERR) ? POLLERR : 0) | ((events & EPOLLHUP) ? POLLHUP : 0);
+	}
+	int epoll_fd = -1;
+#endif
+	std::map<int, int> fds;
+
+};
+
+
+#endif // INCLUDE_POLLER_HPP_
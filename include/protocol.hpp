@@ -0,0 +1,151 @@
+/*
+ * protocol.hpp
+ */
+
+#ifndef INCLUDE_PROTOCOL_HPP_
+#define INCLUDE_PROTOCOL_HPP_
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <cstdint>
+
+/*
+ * Wire protocol between chia_plot_copy and chia_plot_sink.
+ *
+ * Legacy (version 1), all integers in host byte order:
+ *   client: file_size (8)
+ *   sink:   cmd (1), once a drive is assigned: 1 = send, 0 = no space
+ *   client: name_len (2), name, file data
+ *
+ * Version 2, all integers little-endian:
+ *   client: magic (8), version (2), capabilities (8), file_size (8), name_len (2), name
+ *   client: transfer_id (8) if it offers CAP_RESUME
+ *   client: stripe_id (8), stripe_index (2), num_stripes (2) if it offers CAP_STRIPE
+ *   sink:   magic (8), version (2), capabilities (8), right away
+ *   sink:   cmd (1), once a drive is assigned
+ *   sink:   offset (8) if CAP_RESUME: number of bytes the sink has already
+ *   client: file data, starting at offset
+ *   client: checksum (8) if CAP_CHECKSUM: XXH64 (seed 0) of the whole file, or of the stripe's range,
+ *           including what the sink had already when resuming
+ *   sink:   status (1) if CAP_ACK: 1 = stored, 0 = failed
+ *
+ * Fields which depend on a capability the client offers follow the name, in order of capability bits,
+ * the client sends them whether or not the sink supports it.
+ *
+ * With CAP_STRIPE one file is sent over `num_stripes` connections, each carrying the byte range given
+ * by get_stripe_range(). The client opens stripe 0 first, the others once CAP_STRIPE was negotiated.
+ * All share the same `stripe_id`, each follows the protocol above, but only stripe 0 gets the status.
+ * Striped copies are not resumed, the sink does not accept CAP_RESUME for them.
+ *
+ * With CAP_SESSION (requires CAP_ACK) the sink keeps the connection open after status 1, the client
+ * starts the next copy with a new client hello and negotiates again. After status 0, or once the
+ * connection was idle for too long, the sink closes it.
+ *
+ * The magic read as a legacy file size is ~3 EiB, which no drive can take, so a legacy sink waits
+ * for space, sees the rest of the hello as pending input after about a second and drops the connection.
+ * The client then falls back to version 1 (also after a timeout) and keeps using it for that sink for a while.
+ * Both sides use the lower version and the intersection of capabilities.
+ */
+
+static const char PROTOCOL_MAGIC[8] = {'C', 'H', 'I', 'A', 'S', 'N', 'K', '2'};
+
+static const uint16_t PROTOCOL_VERSION = 2;
+
+static const size_t PROTOCOL_CLIENT_HELLO_SIZE = 8 + 2 + 8 + 8 + 2;		// without name
+static const size_t PROTOCOL_SINK_HELLO_SIZE = 8 + 2 + 8;
+
+static const uint16_t PROTOCOL_MAX_STRIPES = 64;
+static const uint64_t PROTOCOL_STRIPE_ALIGN = 1024 * 1024;
+
+enum capability_e : uint64_t {
+	CAP_ACK = 1,			// sink confirms the file was stored, after close() and rename()
+	CAP_RESUME = 2,			// sink keeps partial files of interrupted copies, client sends only the rest
+	CAP_CHECKSUM = 4,		// client sends a hash of the data, sink deletes the file on mismatch
+	CAP_STRIPE = 8,			// one file over multiple connections
+	CAP_SESSION = 16,		// connection carries more than one copy
+};
+
+
+inline
+void write_le(char* dst, uint64_t value, const size_t num_bytes)
+{
+	for(size_t i = 0; i < num_bytes; ++i) {
+		dst[i] = char(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+inline
+uint64_t read_le(const char* src, const size_t num_bytes)
+{
+	uint64_t out = 0;
+	for(size_t i = 0; i < num_bytes; ++i) {
+		out |= uint64_t(uint8_t(src[i])) << (8 * i);
+	}
+	return out;
+}
+
+inline
+bool is_protocol_magic(const char* src) {
+	return ::memcmp(src, PROTOCOL_MAGIC, 8) == 0;
+}
+
+/*
+ * Identifies one version of a file across connections, to match partial files for CAP_RESUME.
+ * FNV-1a over name, size and modification time.
+ */
+inline
+uint64_t get_transfer_id(const std::string& file_name, const uint64_t file_size, const int64_t mtime)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const auto update = [&hash](const char* data, const size_t num_bytes) {
+		for(size_t i = 0; i < num_bytes; ++i) {
+			hash = (hash ^ uint8_t(data[i])) * 0x100000001b3ull;
+		}
+	};
+	char tmp[16];
+	write_le(tmp, file_size, 8);
+	write_le(tmp + 8, mtime, 8);
+	update(file_name.data(), file_name.size());
+	update(tmp, sizeof(tmp));
+	return hash;
+}
+
+/*
+ * Returns the byte range of stripe `index` out of `num_stripes`, in multiples of PROTOCOL_STRIPE_ALIGN.
+ * Trailing stripes of small files may be empty.
+ */
+inline
+void get_stripe_range(const uint64_t file_size, const uint16_t index, const uint16_t num_stripes, uint64_t& offset, uint64_t& num_bytes)
+{
+	const uint64_t count = num_stripes ? num_stripes : 1;
+	const uint64_t chunk = (((file_size + count - 1) / count + PROTOCOL_STRIPE_ALIGN - 1) / PROTOCOL_STRIPE_ALIGN) * PROTOCOL_STRIPE_ALIGN;
+	offset = std::min<uint64_t>(index * chunk, file_size);
+	num_bytes = std::min<uint64_t>(chunk, file_size - offset);
+}
+
+inline
+std::string get_capabilities_text(const uint64_t caps)
+{
+	std::string out;
+	if(caps & CAP_ACK) {
+		out += "ack";
+	}
+	if(caps & CAP_RESUME) {
+		out += out.empty() ? "resume" : ", resume";
+	}
+	if(caps & CAP_CHECKSUM) {
+		out += out.empty() ? "checksum" : ", checksum";
+	}
+	if(caps & CAP_STRIPE) {
+		out += out.empty() ? "stripe" : ", stripe";
+	}
+	if(caps & CAP_SESSION) {
+		out += out.empty() ? "session" : ", session";
+	}
+	return out.empty() ? "none" : out;
+}
+
+
+#endif // INCLUDE_PROTOCOL_HPP_
@@ -0,0 +1,56 @@
+/*
+ * rate_limiter.hpp
+ */
+
+#ifndef INCLUDE_RATE_LIMITER_HPP_
+#define INCLUDE_RATE_LIMITER_HPP_
+
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+
+/*
+ * Caps the combined throughput of all callers to `bytes_per_sec`.
+ * Each acquire() books its bytes in a shared schedule and sleeps until its slot, allowing a burst of `burst_sec`.
+ */
+class RateLimiter {
+public:
+	RateLimiter(const double bytes_per_sec, const double burst_sec = 0.1)
+		:	bytes_per_sec(bytes_per_sec),
+			burst(std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(burst_sec)))
+	{
+	}
+
+	void acquire(const uint64_t num_bytes)
+	{
+		clock_type::time_point slot;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			const auto now = clock_type::now();
+			next = std::max(next, now - burst);
+			slot = next;
+			next += std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(num_bytes / bytes_per_sec));
+		}
+		std::this_thread::sleep_until(slot);
+	}
+
+	double get_rate() const {
+		return bytes_per_sec;
+	}
+
+private:
+	typedef std::chrono::steady_clock clock_type;
+
+	const double bytes_per_sec;
+	const clock_type::duration burst;
+
+	std::mutex mutex;
+	clock_type::time_point next;
+
+};
+
+
+#endif // INCLUDE_RATE_LIMITER_HPP_
@@ -0,0 +1,542 @@
+/*
+ * uring_engine.hpp
+ */
+
+#ifndef INCLUDE_URING_ENGINE_HPP_
+#define INCLUDE_URING_ENGINE_HPP_
+
+#include <io_uring.hpp>
+#include <file_writer.hpp>
+#include <buffer_pool.hpp>
+
+#include <map>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+
+/*
+ * Completion driven copy engine: a small number of io_uring event loops drive recv() and write() for all jobs.
+ * Each destination is owned by exactly one loop, which limits the number of writes in flight per destination.
+ */
+class UringEngine {
+public:
+	struct job_t {
+		int fd = -1;							// socket to receive from
+		uint64_t num_bytes = 0;					// total bytes to receive
+		std::string dst_key;					// destination (drive) identifier
+		std::string file_path;					// file to write
+		std::function<void(uint64_t num_left, bool is_drive_fail, const std::string& error)> on_finish;
+		std::function<void(size_t num_bytes)> on_data;		// optional, called for received data
+		std::function<void()> on_allocate;		// optional, called once the file was preallocated
+	};
+
+	/*
+	 * If `pool` is given, job buffers are taken from it (and `buffer_size` is ignored).
+	 * Jobs which cannot get any buffer are deferred until other jobs return theirs.
+	 */
+	UringEngine(	const int num_threads, const int queue_depth, const int num_buffers,
+					const size_t buffer_size, const int recv_timeout_sec, const bool direct_io, const bool preallocate,
+					BufferPool* pool = nullptr)
+		:	queue_depth(std::max(queue_depth, 1)),
+			num_buffers(std::max(num_buffers, 2)),
+			buffer_size(pool ? pool->get_slab_size() : ((buffer_size + alignment - 1) / alignment) * alignment),
+			recv_timeout_sec(recv_timeout_sec),
+			direct_io(direct_io),
+			preallocate(preallocate),
+			pool(pool)
+	{
+		for(int i = 0; i < std::max(num_threads, 1); ++i) {
+			loops.emplace_back(new loop_t());
+		}
+		for(auto& loop : loops) {
+			loop->thread = std::thread(&UringEngine::loop_main, this, loop.get());
+		}
+	}
+
+	~UringEngine()
+	{
+		for(auto& loop : loops) {
+			{
+				std::lock_guard<std::mutex> lock(loop->mutex);
+				loop->do_run = false;
+			}
+			loop->wakeup();
+		}
+		for(auto& loop : loops) {
+			if(loop->thread.joinable()) {
+				loop->thread.join();
+			}
+		}
+	}
+
+	void add_job(const job_t& job)
+	{
+		auto& loop = loops[std::hash<std::string>{}(job.dst_key) % loops.size()];
+		{
+			std::lock_guard<std::mutex> lock(loop->mutex);
+			loop->new_jobs.push_back(job);
+		}
+		loop->wakeup();
+	}
+
+private:
+	static constexpr size_t alignment = 4096;
+
+	enum op_type_e {
+		OP_RECV, OP_WRITE, OP_WAKEUP, OP_TIMER
+	};
+
+	struct loop_t;
+	struct job_state_t;
+
+	struct op_t {
+		op_type_e type;
+		job_state_t* job = nullptr;
+		size_t slot = 0;
+	};
+
+	struct slot_t {
+		char* data = nullptr;
+		size_t size = 0;				// bytes received into slot
+		size_t length = 0;				// bytes to write (padded for O_DIRECT)
+		size_t written = 0;
+		uint64_t offset = 0;			// file offset
+		bool is_busy = false;			// being filled or written
+		op_t op;
+	};
+
+	struct drive_t {
+		int num_writes = 0;
+		std::deque<std::pair<job_state_t*, size_t>> queue;
+	};
+
+	struct job_state_t {
+		job_t job;
+		int file_fd = -1;
+		drive_t* drive = nullptr;
+		std::vector<slot_t> slots;
+		op_t recv_op;
+		::__kernel_timespec recv_timeout = {};
+		int recv_slot = -1;				// slot currently being filled
+		bool recv_active = false;
+		uint64_t num_received = 0;
+		uint64_t num_written = 0;
+		size_t num_inflight = 0;
+		bool is_failed = false;
+		bool is_drive_fail = false;
+		std::string error;
+	};
+
+	struct loop_t {
+		std::unique_ptr<IoUring> ring;
+		std::thread thread;
+		std::mutex mutex;
+		bool do_run = true;
+		std::vector<job_t> new_jobs;
+
+		int event_fd = -1;
+		uint64_t event_value = 0;
+		op_t wakeup_op;
+		op_t timer_op;
+		bool timer_active = false;
+		::__kernel_timespec timer_timeout = {};
+		std::deque<job_t> deferred;		// waiting for buffers
+		std::map<std::string, drive_t> drives;
+		std::list<std::unique_ptr<job_state_t>> jobs;
+
+		loop_t() {
+			ring = std::unique_ptr<IoUring>(new IoUring(256));
+			event_fd = ::eventfd(0, EFD_CLOEXEC);
+			if(event_fd < 0) {
+				throw std::runtime_error("eventfd() failed with: " + std::string(strerror(errno)));
+			}
+			wakeup_op.type = OP_WAKEUP;
+			timer_op.type = OP_TIMER;
+		}
+		~loop_t() {
+			::close(event_fd);
+		}
+		void wakeup() {
+			const uint64_t one = 1;
+			if(::write(event_fd, &one, 8) != 8) {
+				// counter overflow, loop is awake anyway
+			}
+		}
+	};
+
+	::io_uring_sqe* get_sqe(IoUring& ring)
+	{
+		while(true) {
+			if(auto* sqe = ring.get_sqe()) {
+				return sqe;
+			}
+			ring.submit();
+		}
+	}
+
+	void post_wakeup(IoUring& ring, loop_t* loop)
+	{
+		auto* sqe = get_sqe(ring);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = loop->event_fd;
+		sqe->addr = (uint64_t)&loop->event_value;
+		sqe->len = 8;
+		sqe->user_data = (uint64_t)&loop->wakeup_op;
+	}
+
+	void post_timer(IoUring& ring, loop_t* loop)
+	{
+		if(loop->timer_active) {
+			return;
+		}
+		loop->timer_timeout.tv_sec = 0;
+		loop->timer_timeout.tv_nsec = 100 * 1000 * 1000;
+
+		auto* sqe = get_sqe(ring);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)&loop->timer_timeout;
+		sqe->len = 1;
+		sqe->user_data = (uint64_t)&loop->timer_op;
+		loop->timer_active = true;
+	}
+
+	void fail(job_state_t* state, const std::string& error, const bool is_drive_fail)
+	{
+		if(!state->is_failed) {
+			state->is_failed = true;
+			state->error = error;
+			// abort pending recv()
+			::shutdown(state->job.fd, SHUT_RDWR);
+		}
+		state->is_drive_fail |= is_drive_fail;
+
+		auto& queue = state->drive->queue;
+		for(auto iter = queue.begin(); iter != queue.end();) {
+			if(iter->first == state) {
+				state->slots[iter->second].is_busy = false;
+				iter = queue.erase(iter);
+			} else {
+				iter++;
+			}
+		}
+	}
+
+	void post_recv(IoUring& ring, job_state_t* state)
+	{
+		if(state->is_failed || state->recv_active || state->num_received >= state->job.num_bytes) {
+			return;
+		}
+		if(state->recv_slot < 0) {
+			for(size_t i = 0; i < state->slots.size(); ++i) {
+				auto& slot = state->slots[i];
+				if(!slot.is_busy) {
+					slot.is_busy = true;
+					slot.size = 0;
+					slot.written = 0;
+					slot.offset = state->num_received;
+					state->recv_slot = i;
+					break;
+				}
+			}
+			if(state->recv_slot < 0) {
+				return;		// all buffers waiting for disk
+			}
+		}
+		auto& slot = state->slots[state->recv_slot];
+		const auto num_bytes = std::min<uint64_t>(buffer_size - slot.size, state->job.num_bytes - state->num_received);
+
+		if(ring.get_space() < 2) {
+			ring.submit();		// recv and its linked timeout must go into the same submission
+		}
+		auto* sqe = get_sqe(ring);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = state->job.fd;
+		sqe->addr = (uint64_t)(slot.data + slot.size);
+		sqe->len = num_bytes;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (uint64_t)&state->recv_op;
+
+		state->recv_timeout.tv_sec = recv_timeout_sec;
+		state->recv_timeout.tv_nsec = 0;
+
+		auto* tsqe = get_sqe(ring);
+		tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+		tsqe->fd = -1;
+		tsqe->addr = (uint64_t)&state->recv_timeout;
+		tsqe->len = 1;
+		tsqe->user_data = 0;
+
+		state->recv_active = true;
+		state->num_inflight++;
+	}
+
+	void post_write(IoUring& ring, job_state_t* state, const size_t index)
+	{
+		auto& slot = state->slots[index];
+		auto* sqe = get_sqe(ring);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = state->file_fd;
+		sqe->addr = (uint64_t)(slot.data + slot.written);
+		sqe->len = slot.length - slot.written;
+		sqe->off = slot.offset + slot.written;
+		sqe->user_data = (uint64_t)&slot.op;
+		state->num_inflight++;
+	}
+
+	void pump_drive(IoUring& ring, drive_t& drive)
+	{
+		while(drive.num_writes < queue_depth && !drive.queue.empty()) {
+			const auto entry = drive.queue.front();
+			drive.queue.pop_front();
+			drive.num_writes++;
+			post_write(ring, entry.first, entry.second);
+		}
+	}
+
+	/*
+	 * Returns false if no buffers are available right now.
+	 */
+	bool start_job(IoUring& ring, loop_t* loop, const job_t& job)
+	{
+		std::vector<buffer_t> buffers;
+		if(pool) {
+			buffers = pool->try_acquire(num_buffers);
+			if(buffers.empty()) {
+				buffers = pool->try_acquire(1);
+			}
+			if(buffers.empty()) {
+				return false;
+			}
+		}
+		std::unique_ptr<job_state_t> state(new job_state_t());
+		state->job = job;
+		state->drive = &loop->drives[job.dst_key];
+		state->recv_op.type = OP_RECV;
+		state->recv_op.job = state.get();
+
+		state->file_fd = ::open(job.file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (direct_io ? O_DIRECT : 0), 0644);
+		if(state->file_fd < 0) {
+			state->file_fd = ::open(job.file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+		if(state->file_fd < 0) {
+			const auto error = "open('" + job.file_path + "') failed with: " + std::string(strerror(errno));
+			if(pool) {
+				pool->release(buffers);
+			}
+			::close(job.fd);
+			job.on_finish(job.num_bytes, true, error);
+			return true;
+		}
+		if(preallocate) {
+			try {
+				if(preallocate_file(state->file_fd, job.num_bytes, job.file_path) && job.on_allocate) {
+					job.on_allocate();
+				}
+			} catch(const std::exception& ex) {
+				state->is_failed = true;
+				state->error = ex.what();
+			}
+		}
+		state->slots.resize(pool ? buffers.size() : num_buffers);
+		for(size_t i = 0; i < state->slots.size(); ++i) {
+			auto& slot = state->slots[i];
+			if(pool) {
+				slot.data = buffers[i].data;
+			} else if(posix_memalign((void**)&slot.data, alignment, buffer_size)) {
+				slot.data = nullptr;
+				state->is_failed = true;
+				state->error = "posix_memalign() failed";
+			}
+			slot.op.type = OP_WRITE;
+			slot.op.job = state.get();
+			slot.op.slot = i;
+		}
+		if(state->is_failed) {
+			finish_job(state.get());
+			return true;
+		}
+		post_recv(ring, state.get());
+		loop->jobs.push_back(std::move(state));
+
+		if(!loop->jobs.back()->num_inflight) {
+			finish_job(loop->jobs.back().get());
+			loop->jobs.pop_back();
+		}
+		return true;
+	}
+
+	void finish_job(job_state_t* state)
+	{
+		auto& job = state->job;
+		if(state->file_fd >= 0) {
+			if(!state->is_failed && ::ftruncate(state->file_fd, job.num_bytes)) {
+				fail(state, "ftruncate('" + job.file_path + "') failed with: " + std::string(strerror(errno)), true);
+			}
+			if(::close(state->file_fd) && !state->is_failed) {
+				fail(state, "close('" + job.file_path + "') failed with: " + std::string(strerror(errno)), true);
+			}
+			state->file_fd = -1;
+		}
+		::close(job.fd);
+
+		std::vector<buffer_t> buffers;
+		for(auto& slot : state->slots) {
+			if(pool) {
+				buffer_t buf;
+				buf.data = slot.data;
+				buffers.push_back(buf);
+			} else {
+				free(slot.data);
+			}
+			slot.data = nullptr;
+		}
+		if(pool) {
+			pool->release(buffers);
+		}
+		job.on_finish(state->is_failed ? std::max<uint64_t>(job.num_bytes - state->num_written, 1) : 0, state->is_drive_fail, state->error);
+	}
+
+	void on_recv(IoUring& ring, job_state_t* state, const int res)
+	{
+		state->recv_active = false;
+		if(state->is_failed) {
+			return;
+		}
+		if(res <= 0) {
+			if(res == 0) {
+				fail(state, "recv() failed with: EOF", false);
+			} else if(res == -ECANCELED) {
+				fail(state, "recv() failed with: timeout", false);
+			} else {
+				fail(state, "recv() failed with: " + std::string(strerror(-res)), false);
+			}
+			return;
+		}
+		auto& slot = state->slots[state->recv_slot];
+		slot.size += res;
+		state->num_received += res;
+		if(state->job.on_data) {
+			state->job.on_data(res);
+		}
+
+		if(slot.size == buffer_size || state->num_received == state->job.num_bytes) {
+			slot.length = slot.size;
+			if(direct_io) {
+				slot.length = ((slot.size + alignment - 1) / alignment) * alignment;
+				::memset(slot.data + slot.size, 0, slot.length - slot.size);
+			}
+			state->drive->queue.emplace_back(state, state->recv_slot);
+			state->recv_slot = -1;
+			pump_drive(ring, *state->drive);
+		}
+		post_recv(ring, state);
+	}
+
+	void on_write(IoUring& ring, job_state_t* state, const size_t index, const int res)
+	{
+		auto& slot = state->slots[index];
+		auto& drive = *state->drive;
+		if(res > 0 && !state->is_failed) {
+			slot.written += res;
+			if(slot.written < slot.length) {
+				post_write(ring, state, index);		// short write, continue with the rest
+				return;
+			}
+			state->num_written += slot.size;
+		}
+		if(res <= 0 && !state->is_failed) {
+			fail(state, "write('" + state->job.file_path + "') failed with: " + std::string(res < 0 ? strerror(-res) : "EOF"), true);
+		}
+		slot.is_busy = false;
+		drive.num_writes--;
+		pump_drive(ring, drive);
+		post_recv(ring, state);
+	}
+
+	void loop_main(loop_t* loop)
+	{
+		auto& ring = loop->ring;
+		post_wakeup(*ring, loop);
+
+		while(true) {
+			std::vector<job_t> new_jobs;
+			{
+				std::lock_guard<std::mutex> lock(loop->mutex);
+				if(!loop->do_run && loop->jobs.empty() && loop->new_jobs.empty() && loop->deferred.empty()) {
+					break;
+				}
+				new_jobs.swap(loop->new_jobs);
+			}
+			auto& deferred = loop->deferred;
+			deferred.insert(deferred.end(), new_jobs.begin(), new_jobs.end());
+			while(!deferred.empty() && start_job(*ring, loop, deferred.front())) {
+				deferred.pop_front();
+			}
+			if(!deferred.empty()) {
+				post_timer(*ring, loop);	// retry when other loops have returned buffers
+			}
+			ring->submit(1);
+
+			while(auto* cqe = ring->peek_cqe())
+			{
+				auto* op = (op_t*)cqe->user_data;
+				const auto res = cqe->res;
+				ring->cqe_seen();
+				if(!op) {
+					continue;		// linked timeout
+				}
+				if(op->type == OP_WAKEUP) {
+					post_wakeup(*ring, loop);
+					continue;
+				}
+				if(op->type == OP_TIMER) {
+					loop->timer_active = false;
+					continue;
+				}
+				auto* state = op->job;
+				state->num_inflight--;
+				switch(op->type) {
+					case OP_RECV: on_recv(*ring, state, res); break;
+					case OP_WRITE: on_write(*ring, state, op->slot, res); break;
+					default: break;
+				}
+			}
+			for(auto iter = loop->jobs.begin(); iter != loop->jobs.end();) {
+				auto* state = iter->get();
+				if(!state->num_inflight && (state->is_failed || state->num_written == state->job.num_bytes)) {
+					finish_job(state);
+					iter = loop->jobs.erase(iter);
+				} else {
+					iter++;
+				}
+			}
+		}
+	}
+
+private:
+	const int queue_depth;
+	const int num_buffers;
+	const size_t buffer_size;
+	const int recv_timeout_sec;
+	const bool direct_io;
+	const bool preallocate;
+	BufferPool* const pool;
+
+	std::vector<std::unique_ptr<loop_t>> loops;
+
+};
+
+
+#endif // INCLUDE_URING_ENGINE_HPP_
@@ -0,0 +1,407 @@
+/*
+ * chia_plot_bench.cpp
+ */
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <atomic>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#define _SILENCE_EXPERIMENTAL_FILESYSTEM_DEPRECATION_WARNING
+#include <experimental/filesystem>
+
+#include <cxxopts.hpp>
+#include <stdiox.hpp>
+
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+
+extern char** environ;
+
+namespace fs = std::experimental::filesystem;
+
+
+static std::string g_sink_path;
+static std::string g_dst_path = "/dev/shm/chia_plot_bench";
+static std::string g_source_file;
+static int g_port = 14100;
+static int g_num_senders = 4;
+static int g_num_files = 1;
+static int g_num_runs = 1;
+static uint64_t g_file_size = 0;
+static size_t g_chunk_size = 1024 * 1024;
+static bool g_verbose = false;
+
+
+struct bench_mode_t {
+	std::string name;
+	std::vector<std::string> args;		// extra sink arguments
+};
+
+struct result_t {
+	double elapsed_sec = 0;
+	double sink_cpu_sec = 0;			// user + system time of the sink process
+	double sender_cpu_sec = 0;			// user + system time of this process while sending
+	uint64_t num_bytes = 0;
+	std::vector<double> job_speed;		// [MB/s] per file
+	size_t num_failed = 0;
+};
+
+
+inline
+double get_time_sec() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline
+double get_cpu_sec(const ::rusage& usage) {
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static
+std::vector<bench_mode_t> get_modes(const std::string& list)
+{
+	std::vector<bench_mode_t> out;
+	std::istringstream in(list);
+	std::string name;
+	while(std::getline(in, name, ',')) {
+		if(name == "recv") {
+			out.push_back({name, {}});
+		} else if(name == "pipeline") {
+			out.push_back({name, {"-b", "4"}});
+		} else if(name == "writers") {
+			out.push_back({name, {"-W"}});
+		} else if(name == "splice") {
+			out.push_back({name, {"-S"}});
+		} else if(name == "direct") {
+			out.push_back({name, {"-D", "-b", "4"}});
+		} else if(name == "uring") {
+			out.push_back({name, {"-E", "uring"}});
+		} else {
+			throw std::logic_error("invalid mode: " + name);
+		}
+	}
+	return out;
+}
+
+static
+pid_t start_sink(const bench_mode_t& mode)
+{
+	std::vector<std::string> args = {
+		g_sink_path, "-p", std::to_string(g_port), "-r", std::to_string(g_num_senders), "--group-devices=false"
+	};
+	args.insert(args.end(), mode.args.begin(), mode.args.end());
+	args.push_back("--");
+	args.push_back(g_dst_path);
+
+	std::vector<char*> argv;
+	for(auto& arg : args) {
+		argv.push_back(&arg[0]);
+	}
+	argv.push_back(nullptr);
+
+	::posix_spawn_file_actions_t actions;
+	::posix_spawn_file_actions_init(&actions);
+	if(!g_verbose) {
+		::posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+		::posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+	}
+	pid_t pid = -1;
+	const int ret = ::posix_spawn(&pid, g_sink_path.c_str(), &actions, nullptr, argv.data(), environ);
+	::posix_spawn_file_actions_destroy(&actions);
+	if(ret) {
+		throw std::runtime_error("posix_spawn('" + g_sink_path + "') failed with: " + std::string(strerror(ret)));
+	}
+	return pid;
+}
+
+static
+::sockaddr_in get_sink_addr()
+{
+	::sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(g_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return addr;
+}
+
+static
+void wait_for_sink(const pid_t pid)
+{
+	for(int i = 0; i < 100; ++i) {
+		const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+		const auto addr = get_sink_addr();
+		const bool is_up = ::connect(fd, (::sockaddr*)&addr, sizeof(addr)) == 0;
+		::close(fd);		// sink sees EOF before the size and drops the connection
+		if(is_up) {
+			return;
+		}
+		int status = 0;
+		if(::waitpid(pid, &status, WNOHANG) == pid) {
+			throw std::runtime_error("sink exited during startup (run with -v to see why)");
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	throw std::runtime_error("sink did not start listening on port " + std::to_string(g_port));
+}
+
+static
+void send_all(const int fd, const void* src, const size_t num_bytes)
+{
+	size_t offset = 0;
+	while(offset < num_bytes) {
+		const auto num_sent = ::send(fd, (const char*)src + offset, num_bytes - offset, 0);
+		if(num_sent <= 0) {
+			throw std::runtime_error("send() failed with: " + std::string(strerror(errno)));
+		}
+		offset += num_sent;
+	}
+}
+
+/*
+ * Sends one file using the same protocol as chia_plot_copy, either synthetic data from memory or `g_source_file` via sendfile().
+ */
+static
+void send_job(const std::string& file_name, const std::vector<char>& data)
+{
+	const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		throw std::runtime_error("socket() failed with: " + std::string(strerror(errno)));
+	}
+	FILE* src = nullptr;
+	try {
+		const auto addr = get_sink_addr();
+		if(::connect(fd, (::sockaddr*)&addr, sizeof(addr)) < 0) {
+			throw std::runtime_error("connect() failed with: " + std::string(strerror(errno)));
+		}
+		send_all(fd, &g_file_size, 8);
+		{
+			char ret = -1;
+			if(::recv(fd, &ret, 1, MSG_WAITALL) != 1 || ret != 1) {
+				throw std::runtime_error("sink rejected file");
+			}
+		}
+		const uint16_t name_len = file_name.size();
+		send_all(fd, &name_len, 2);
+		send_all(fd, file_name.data(), name_len);
+
+		if(!g_source_file.empty()) {
+			src = fopen(g_source_file.c_str(), "rb");
+			if(!src) {
+				throw std::runtime_error("fopen() failed for " + g_source_file);
+			}
+			uint64_t total_bytes = 0;
+			while(total_bytes < g_file_size) {
+				const auto num_bytes = ::sendfile(fd, ::fileno(src), NULL, std::min<uint64_t>(g_file_size - total_bytes, g_chunk_size * 64));
+				if(num_bytes <= 0) {
+					throw std::runtime_error("sendfile() failed with: " + std::string(strerror(errno)));
+				}
+				total_bytes += num_bytes;
+			}
+			fclose(src);
+			src = nullptr;
+		} else {
+			uint64_t total_bytes = 0;
+			while(total_bytes < g_file_size) {
+				const auto num_bytes = std::min<uint64_t>(g_file_size - total_bytes, data.size());
+				send_all(fd, data.data(), num_bytes);
+				total_bytes += num_bytes;
+			}
+		}
+		// wait for the sink to close the connection, which it does once all data is written
+		char tmp;
+		::recv(fd, &tmp, 1, 0);
+	} catch(...) {
+		if(src) {
+			fclose(src);
+		}
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+}
+
+static
+result_t run_mode(const bench_mode_t& mode, const int run)
+{
+	fs::remove_all(g_dst_path);
+	fs::create_directories(g_dst_path);
+
+	const auto pid = start_sink(mode);
+	result_t out;
+	try {
+		wait_for_sink(pid);
+	} catch(...) {
+		::kill(pid, SIGKILL);
+		::waitpid(pid, nullptr, 0);
+		throw;
+	}
+	std::vector<char> data(g_chunk_size);
+	for(size_t i = 0; i < data.size(); ++i) {
+		data[i] = char(i * 7 + run);
+	}
+	std::mutex mutex;
+	std::atomic<int> next_file {0};
+
+	::rusage self_begin = {};
+	::getrusage(RUSAGE_SELF, &self_begin);
+	const auto time_begin = get_time_sec();
+
+	std::vector<std::thread> senders;
+	for(int i = 0; i < g_num_senders; ++i) {
+		senders.emplace_back([&]() {
+			for(int k = next_file++; k < g_num_senders * g_num_files; k = next_file++) {
+				const auto file_name = "bench_" + mode.name + "_" + std::to_string(k) + ".plot";
+				const auto job_begin = get_time_sec();
+				try {
+					send_job(file_name, data);
+					const auto speed = g_file_size / pow(1024, 2) / (get_time_sec() - job_begin);
+					std::lock_guard<std::mutex> lock(mutex);
+					out.job_speed.push_back(speed);
+					out.num_bytes += g_file_size;
+				} catch(const std::exception& ex) {
+					std::lock_guard<std::mutex> lock(mutex);
+					std::cerr << "Job " << file_name << " failed with: " << ex.what() << std::endl;
+					out.num_failed++;
+				}
+			}
+		});
+	}
+	for(auto& thread : senders) {
+		thread.join();
+	}
+	// close() and rename() on the sink side may still be pending
+	for(int i = 0; i < 100; ++i) {
+		size_t num_done = 0;
+		for(const auto& entry : fs::directory_iterator(g_dst_path)) {
+			num_done += entry.path().extension() == ".plot";
+		}
+		if(num_done >= out.job_speed.size()) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	out.elapsed_sec = get_time_sec() - time_begin;
+
+	::rusage self_end = {};
+	::getrusage(RUSAGE_SELF, &self_end);
+	out.sender_cpu_sec = get_cpu_sec(self_end) - get_cpu_sec(self_begin);
+
+	::kill(pid, SIGINT);
+	int status = 0;
+	::rusage usage = {};
+	::wait4(pid, &status, 0, &usage);
+	out.sink_cpu_sec = get_cpu_sec(usage);
+
+	fs::remove_all(g_dst_path);
+	return out;
+}
+
+/*
+ * Jain's fairness index: 1 if all jobs got the same throughput, 1/n if one job got everything.
+ */
+static
+double get_fairness(const std::vector<double>& list)
+{
+	double sum = 0;
+	double sum_sq = 0;
+	for(const auto value : list) {
+		sum += value;
+		sum_sq += value * value;
+	}
+	return sum_sq > 0 ? sum * sum / (list.size() * sum_sq) : 0;
+}
+
+
+int main(int argc, char** argv) try
+{
+	cxxopts::Options options("chia_plot_bench",
+		"Loopback benchmark for chia_plot_sink, with synthetic senders speaking the chia_plot_copy protocol.\n\n"
+		"Usage: chia_plot_bench -n 4 -s 1024 -m recv,pipeline,splice\n"
+	);
+
+	std::string mode_list = "recv,pipeline,writers,splice,uring";
+	int file_size_mb = 1024;
+
+	options.allow_unrecognised_options().add_options()(
+		"sink", "Path to chia_plot_sink (default = next to this binary)", cxxopts::value<std::string>(g_sink_path))(
+		"d, destination", "Destination folder for the sink, should be on tmpfs (default = /dev/shm/chia_plot_bench)", cxxopts::value<std::string>(g_dst_path))(
+		"m, modes", "Receive paths to compare: recv, pipeline, writers, splice, direct, uring (default = all but direct)", cxxopts::value<std::string>(mode_list))(
+		"n, senders", "Number of concurrent senders (default = 4)", cxxopts::value<int>(g_num_senders))(
+		"f, files", "Number of files per sender (default = 1)", cxxopts::value<int>(g_num_files))(
+		"s, size", "File size [MiB] (default = 1024)", cxxopts::value<int>(file_size_mb))(
+		"R, runs", "Number of runs per mode (default = 1)", cxxopts::value<int>(g_num_runs))(
+		"source", "Send this file via sendfile() like chia_plot_copy, instead of synthetic data", cxxopts::value<std::string>(g_source_file))(
+		"p, port", "Port for the sink (default = 14100)", cxxopts::value<int>(g_port))(
+		"v, verbose", "Show sink output", cxxopts::value<bool>(g_verbose))(
+		"help", "Print help");
+
+	const auto args = options.parse(argc, argv);
+
+	if(args.count("help")) {
+		std::cout << options.help({""}) << std::endl;
+		return 0;
+	}
+	if(g_sink_path.empty()) {
+		const std::string self(argv[0]);
+		const auto pos = self.find_last_of('/');
+		g_sink_path = (pos != std::string::npos ? self.substr(0, pos + 1) : std::string("./")) + "chia_plot_sink";
+	}
+	g_num_senders = std::max(g_num_senders, 1);
+	g_num_files = std::max(g_num_files, 1);
+	g_file_size = uint64_t(file_size_mb) * 1024 * 1024;
+
+	if(!g_source_file.empty()) {
+		const auto size = fs::file_size(g_source_file);
+		if(size < g_file_size) {
+			throw std::logic_error("source file smaller than --size");
+		}
+	}
+	const auto modes = get_modes(mode_list);
+	const auto total_gb = uint64_t(g_num_senders) * g_num_files * g_file_size / pow(1024, 3);
+	if(fs::exists(g_dst_path) && fs::space(fs::path(g_dst_path)).available < total_gb * pow(1024, 3) * 1.1) {
+		std::cerr << "Warning: " << g_dst_path << " may be too small for " << total_gb << " GiB" << std::endl;
+	}
+	std::cout << "Senders: " << g_num_senders << " x " << g_num_files << " x " << file_size_mb << " MiB ("
+			<< (g_source_file.empty() ? "synthetic" : "sendfile") << "), destination " << g_dst_path << std::endl;
+
+	std::cout.precision(4);
+	for(const auto& mode : modes) {
+		for(int run = 0; run < g_num_runs; ++run) {
+			const auto res = run_mode(mode, run);
+			const auto gb = res.num_bytes / pow(1024, 3);
+			double min_speed = 0;
+			double max_speed = 0;
+			if(!res.job_speed.empty()) {
+				min_speed = *std::min_element(res.job_speed.begin(), res.job_speed.end());
+				max_speed = *std::max_element(res.job_speed.begin(), res.job_speed.end());
+			}
+			std::cout << mode.name << (g_num_runs > 1 ? "[" + std::to_string(run) + "]" : "") << ": "
+					<< res.num_bytes / pow(1024, 2) / res.elapsed_sec << " MB/s aggregate, "
+					<< "sink CPU " << (gb > 0 ? res.sink_cpu_sec / gb : 0) << " sec/GB, "
+					<< "sender CPU " << (gb > 0 ? res.sender_cpu_sec / gb : 0) << " sec/GB, "
+					<< "per job " << min_speed << " - " << max_speed << " MB/s, "
+					<< "fairness " << get_fairness(res.job_speed);
+			if(res.num_failed) {
+				std::cout << ", " << res.num_failed << " failed";
+			}
+			std::cout << std::endl;
+		}
+	}
+	return 0;
+}
+catch(const std::exception& ex) {
+	std::cerr << "Failed with: " << ex.what() << std::endl;
+	return -1;
+}
@@ -5,24 +5,59 @@
  *      Author: mad
  */
 
+#include <map>
 #include <mutex>
 #include <string>
+#include <vector>
+#include <memory>
 #include <chrono>
+#include <random>
+#include <atomic>
+#include <thread>
 #include <cmath>
+#include <csignal>
 
 #define _SILENCE_EXPERIMENTAL_FILESYSTEM_DEPRECATION_WARNING
 #include <experimental/filesystem>
 
 #include <cxxopts.hpp>
 #include <stdiox.hpp>
+#include <protocol.hpp>
+#include <xxhash64.hpp>
 
 
-#ifndef _WIN32
+#ifdef _WIN32
+#define POLL WSAPoll
+#else
+#include <poll.h>
 #include <sys/sendfile.h>
+#define POLL ::poll
 #endif
 
 
 size_t g_read_chunk_size = 65536;
+int g_protocol = PROTOCOL_VERSION;
+int g_hello_timeout_sec = 10;
+int g_num_retries = 3;
+int g_retry_delay_sec = 10;
+int g_num_stripes = 1;
+bool g_checksum = true;
+bool g_session = true;
+std::atomic<bool> g_is_legacy_warned {false};
+
+static const int64_t LEGACY_REPROBE_MS = 600 * 1000;		// how long a sink is assumed to be legacy before trying version 2 again
+
+struct sink_info_t {
+	int version = 0;
+	int64_t probe_time = 0;		// [ms]
+};
+
+std::mutex g_probe_mutex;		// held while probing a sink of unknown version, so it is probed only once
+std::mutex g_sink_mutex;
+std::map<uint64_t, sink_info_t> g_sinks;		// protocol version of each sink, by address and port
+
+std::mutex g_session_mutex;
+std::vector<int> g_sessions;		// idle connections kept open by the sink (CAP_SESSION)
 
 
 #ifdef _WIN32
@@ -82,7 +117,273 @@ void send_bytes(const int fd, const void* src, const size_t num_bytes)
 	}
 }
 
-uint64_t send_file(const std::string& src_path, const std::string& dst_host, const int dst_port)
+inline
+uint64_t get_sink_key(const ::sockaddr_in& addr) {
+	return (uint64_t(addr.sin_addr.s_addr) << 16) | addr.sin_port;
+}
+
+/*
+ * Returns the protocol version the sink answered with, or 0 if unknown.
+ * A legacy sink is probed again once LEGACY_REPROBE_MS passed, not before,
+ * since every probe stalls a legacy sink for about a second.
+ */
+int get_sink_version(const ::sockaddr_in& addr)
+{
+	std::lock_guard<std::mutex> lock(g_sink_mutex);
+	auto iter = g_sinks.find(get_sink_key(addr));
+	if(iter == g_sinks.end()) {
+		return 0;
+	}
+	const auto& info = iter->second;
+	if(info.version < 2 && get_time_millis() - info.probe_time > LEGACY_REPROBE_MS) {
+		g_sinks.erase(iter);
+		return 0;
+	}
+	return info.version;
+}
+
+void set_sink_version(const ::sockaddr_in& addr, const int version)
+{
+	std::lock_guard<std::mutex> lock(g_sink_mutex);
+	auto& info = g_sinks[get_sink_key(addr)];
+	info.version = version;
+	info.probe_time = get_time_millis();
+}
+
+int connect_sink(const ::sockaddr_in& addr)
+{
+	const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		throw std::runtime_error("socket() failed with: " + get_socket_error_text());
+	}
+	if(::connect(fd, (const ::sockaddr*)&addr, sizeof(addr)) < 0) {
+		CLOSESOCKET(fd);
+		throw std::runtime_error("connect() failed with: " + get_socket_error_text());
+	}
+	return fd;
+}
+
+struct stripe_info_t {
+	uint64_t id = 0;
+	uint16_t index = 0;
+	uint16_t count = 1;
+};
+
+/*
+ * Sends the version 2 header and waits for the sink to answer with its own.
+ * Returns false if the sink does not answer in time or drops the connection (ie. legacy sink),
+ * otherwise true with the negotiated `capabilities`.
+ */
+bool send_hello(const int fd, const uint64_t file_size, const std::string& file_name, const uint64_t transfer_id,
+				const stripe_info_t& stripe, uint64_t& capabilities)
+{
+	uint64_t offered = CAP_ACK | CAP_RESUME;
+	if(g_checksum) {
+		offered |= CAP_CHECKSUM;
+	}
+	if(stripe.count > 1) {
+		offered |= CAP_STRIPE;
+	}
+	if(g_session && stripe.index == 0) {
+		offered |= CAP_SESSION;
+	}
+	std::string hello(PROTOCOL_CLIENT_HELLO_SIZE, 0);
+	::memcpy(&hello[0], PROTOCOL_MAGIC, 8);
+	write_le(&hello[8], PROTOCOL_VERSION, 2);
+	write_le(&hello[10], offered, 8);
+	write_le(&hello[18], file_size, 8);
+	write_le(&hello[26], file_name.size(), 2);
+	hello += file_name;
+	{
+		char tmp[8];
+		write_le(tmp, transfer_id, 8);
+		hello.append(tmp, sizeof(tmp));
+	}
+	if(offered & CAP_STRIPE) {
+		char tmp[12];
+		write_le(tmp, stripe.id, 8);
+		write_le(tmp + 8, stripe.index, 2);
+		write_le(tmp + 10, stripe.count, 2);
+		hello.append(tmp, sizeof(tmp));
+	}
+	send_bytes(fd, hello.data(), hello.size());
+
+	::pollfd entry = {};
+	entry.fd = fd;
+	entry.events = POLLIN;
+	if(POLL(&entry, 1, g_hello_timeout_sec * 1000) <= 0) {
+		return false;
+	}
+	char reply[PROTOCOL_SINK_HELLO_SIZE];
+	try {
+		recv_bytes(reply, fd, sizeof(reply));
+	} catch(...) {
+		return false;
+	}
+	if(!is_protocol_magic(reply) || read_le(reply + 8, 2) < 2) {
+		throw std::runtime_error("invalid answer from sink");
+	}
+	capabilities = read_le(reply + 10, 8) & offered;
+	return true;
+}
+
+/*
+ * Waits for the sink to assign a drive.
+ */
+void recv_command(const int fd)
+{
+	char ret = -1;
+	recv_bytes(&ret, fd, 1);
+	if(ret != 1) {
+		if(ret == 0) {
+			throw std::runtime_error("no space left on destination");
+		} else {
+			throw std::runtime_error("unknown error on destination");
+		}
+	}
+}
+
+/*
+ * Hashes `num_bytes` of `src_path` from `offset` in a separate thread, since sendfile() never shows us the data.
+ * Reading just behind or ahead of sendfile() is served from the page cache.
+ */
+class FileHasher {
+public:
+	FileHasher(const std::string& src_path, const uint64_t offset, const uint64_t num_bytes)
+	{
+		thread = std::thread([this, src_path, offset, num_bytes]() {
+			FILE* file = fopen(src_path.c_str(), "rb");
+			if(!file || FSEEK(file, offset, SEEK_SET)) {
+				error = "fopen() failed for " + src_path + " (" + std::string(strerror(errno)) + ")";
+				if(file) {
+					fclose(file);
+				}
+				return;
+			}
+			std::vector<char> buffer(1024 * 1024);
+			uint64_t num_left = num_bytes;
+			while(num_left && !do_abort) {
+				const auto num_read = fread(buffer.data(), 1, std::min<uint64_t>(num_left, buffer.size()), file);
+				hasher.update(buffer.data(), num_read);
+				num_left -= num_read;
+				if(num_read == 0) {
+					if(ferror(file)) {
+						error = "fread() failed for " + src_path;
+					}
+					break;
+				}
+			}
+			fclose(file);
+		});
+	}
+
+	~FileHasher() {
+		do_abort = true;
+		if(thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	/*
+	 * Waits for the hash of all `num_bytes`, throws on read error.
+	 */
+	uint64_t get_digest(const uint64_t num_bytes)
+	{
+		thread.join();
+		thread = std::thread();
+		if(!error.empty()) {
+			throw std::runtime_error(error);
+		}
+		if(hasher.get_total_bytes() != num_bytes) {
+			throw std::runtime_error("file changed while sending");
+		}
+		return hasher.digest();
+	}
+
+private:
+	XXHash64 hasher;
+	std::string error;
+	std::atomic<bool> do_abort {false};
+	std::thread thread;
+
+};
+
+/*
+ * Sends `num_bytes` of `src_path` starting at `offset`, followed by its checksum if `verify`.
+ * The checksum covers the data from `hash_offset` on, which includes what the sink has already when resuming.
+ * Safe to call from multiple threads for the same `src`.
+ */
+void send_range(const int fd, FILE* src, const std::string& src_path, const uint64_t offset, const uint64_t num_bytes,
+				const bool verify, const uint64_t hash_offset)
+{
+	const uint64_t num_hashed = offset + num_bytes - hash_offset;
+	std::shared_ptr<FileHasher> hasher;
+	if(verify) {
+		hasher = std::make_shared<FileHasher>(src_path, hash_offset, num_hashed);
+	}
+	uint64_t total_bytes = 0;
+#ifdef _WIN32
+	FILE* file = fopen(src_path.c_str(), "rb");
+	if(!file || FSEEK(file, offset, SEEK_SET)) {
+		if(file) {
+			fclose(file);
+		}
+		throw std::runtime_error("fopen() failed for " + src_path + " (" + std::string(strerror(errno)) + ")");
+	}
+	std::vector<uint8_t> buffer(g_read_chunk_size * 16);
+	while(total_bytes < num_bytes) {
+		const auto num_read = fread(buffer.data(), 1, std::min<uint64_t>(num_bytes - total_bytes, buffer.size()), file);
+		if(num_read == 0) {
+			break;
+		}
+		try {
+			send_bytes(fd, buffer.data(), num_read);
+		} catch(...) {
+			fclose(file);
+			throw;
+		}
+		total_bytes += num_read;
+	}
+	fclose(file);
+#else
+	const auto chunk_size = g_read_chunk_size * 1024;
+	::off_t file_offset = offset;
+	while(total_bytes < num_bytes) {
+		const auto ret = ::sendfile(fd, ::fileno(src), &file_offset, std::min<uint64_t>(num_bytes - total_bytes, chunk_size));
+		if(ret < 0) {
+			throw std::runtime_error("sendfile() failed with: " + get_socket_error_text());
+		}
+		if(ret == 0) {
+			break;
+		}
+		total_bytes += ret;
+	}
+#endif
+	if(total_bytes != num_bytes) {
+		throw std::runtime_error("unexpected end of file (" + std::to_string(offset + total_bytes) + " / " + std::to_string(offset + num_bytes) + ")");
+	}
+	if(hasher) {
+		char tmp[8];
+		write_le(tmp, hasher->get_digest(num_hashed), 8);
+		send_bytes(fd, tmp, sizeof(tmp));
+	}
+}
+
+/*
+ * Returns an idle connection from a previous copy, or -1 if there is none.
+ */
+int get_session()
+{
+	std::lock_guard<std::mutex> lock(g_session_mutex);
+	if(g_sessions.empty()) {
+		return -1;
+	}
+	const int fd = g_sessions.back();
+	g_sessions.pop_back();
+	return fd;
+}
+
+uint64_t send_file(const std::string& src_path, const ::sockaddr_in& dst_addr)
 {
 	FILE* src = fopen(src_path.c_str(), "rb");
 	if(!src) {
@@ -92,76 +393,168 @@ uint64_t send_file(const std::string& src_path, const std::string& dst_host, con
 	const uint64_t file_size = FTELL(src);
 	FSEEK(src, 0, SEEK_SET);
 
+	std::string file_name;
+	{
+		const auto pos = src_path.find_last_of("/\\");
+		if(pos != std::string::npos) {
+			file_name = src_path.substr(pos + 1);
+		} else {
+			file_name = src_path;
+		}
+	}
+	int64_t mtime = 0;
+	try {
+		const auto time = std::experimental::filesystem::last_write_time(src_path);
+		mtime = std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
+	} catch(...) {
+		// only changes the transfer id
+	}
+	const auto transfer_id = get_transfer_id(file_name, file_size, mtime);
+
+	stripe_info_t stripe;
+	stripe.count = std::max(std::min(g_num_stripes, int(PROTOCOL_MAX_STRIPES)), 1);
+	if(stripe.count > 1) {
+		std::random_device device;
+		stripe.id = (uint64_t(device()) << 32) | device();
+	}
+
 	int fd = -1;
+	std::vector<int> stripe_fds;		// other stripes, if negotiated
+	uint64_t offset = 0;
 	uint64_t total_bytes = 0;
+	uint64_t capabilities = 0;
 	try {
-		fd = ::socket(AF_INET, SOCK_STREAM, 0);
-		if(fd < 0) {
-			throw std::runtime_error("socket() failed with: " + get_socket_error_text());
+		bool is_legacy = g_protocol < 2 || get_sink_version(dst_addr) == 1;
+		if(!is_legacy) {
+			fd = get_session();
 		}
-		::sockaddr_in addr = get_sockaddr_byname(dst_host, dst_port);
-		if(::connect(fd, (::sockaddr*)&addr, sizeof(addr)) < 0) {
-			throw std::runtime_error("connect() failed with: " + get_socket_error_text());
+		if(fd >= 0) {
+			// the sink may have closed it in the meantime, then start over with a new connection
+			bool is_alive = false;
+			try {
+				is_alive = send_hello(fd, file_size, file_name, transfer_id, stripe, capabilities);
+			} catch(...) {
+				// ignore
+			}
+			if(!is_alive) {
+				CLOSESOCKET(fd);
+				fd = -1;
+			}
 		}
-		send_bytes(fd, &file_size, 8);
-		{
-			char ret = -1;
-			recv_bytes(&ret, fd, 1);
-			if(ret != 1) {
-				if(ret == 0) {
-					throw std::runtime_error("no space left on destination");
+		if(fd < 0) {
+			std::unique_lock<std::mutex> probe_lock(g_probe_mutex, std::defer_lock);
+			if(!is_legacy && get_sink_version(dst_addr) == 0) {
+				probe_lock.lock();		// other copies wait for the result
+				is_legacy = get_sink_version(dst_addr) == 1;
+			}
+			fd = connect_sink(dst_addr);
+
+			// a slow sink looks the same as a legacy one, so it is probed again after a while
+			if(!is_legacy) {
+				if(send_hello(fd, file_size, file_name, transfer_id, stripe, capabilities)) {
+					set_sink_version(dst_addr, 2);
 				} else {
-					throw std::runtime_error("unknown error on destination");
+					if(!g_is_legacy_warned.exchange(true)) {
+						std::cout << "Sink did not answer protocol version 2, falling back to legacy protocol (use --protocol 1 to skip the check)" << std::endl;
+					}
+					set_sink_version(dst_addr, 1);
+					const int legacy_fd = connect_sink(dst_addr);
+					CLOSESOCKET(fd);
+					fd = legacy_fd;
+					is_legacy = true;
 				}
 			}
 		}
-		std::string file_name;
-		{
-			const auto pos = src_path.find_last_of("/\\");
-			if(pos != std::string::npos) {
-				file_name = src_path.substr(pos + 1);
-			} else {
-				file_name = src_path;
+		if(capabilities & CAP_STRIPE) {
+			for(stripe.index = 1; stripe.index < stripe.count; ++stripe.index) {
+				stripe_fds.push_back(connect_sink(dst_addr));
+				uint64_t stripe_caps = 0;
+				if(!send_hello(stripe_fds.back(), file_size, file_name, transfer_id, stripe, stripe_caps) || !(stripe_caps & CAP_STRIPE)) {
+					throw std::runtime_error("sink rejected stripe " + std::to_string(stripe.index));
+				}
 			}
 		}
-		{
+		if(is_legacy) {
+			send_bytes(fd, &file_size, 8);
+		}
+		recv_command(fd);
+		for(const auto stripe_fd : stripe_fds) {
+			recv_command(stripe_fd);
+		}
+		if(capabilities & CAP_RESUME) {
+			char tmp[8];
+			recv_bytes(tmp, fd, sizeof(tmp));
+			offset = read_le(tmp, 8);
+			if(offset > file_size) {
+				throw std::runtime_error("invalid resume offset from destination");
+			}
+			if(offset) {
+				std::cout << "Resuming " << src_path << " at " << offset / pow(1024, 3) << " GiB" << std::endl;
+			}
+		}
+		if(is_legacy) {
 			const uint16_t name_len = file_name.size();
 			send_bytes(fd, &name_len, 2);
 			send_bytes(fd, file_name.data(), name_len);
 		}
+		const bool verify = capabilities & CAP_CHECKSUM;
 
-#ifdef _WIN32
-		std::vector<uint8_t> buffer(g_read_chunk_size * 16);
-		while(true) {
-			const auto num_bytes = fread(buffer.data(), 1, buffer.size(), src);
-			send_bytes(fd, buffer.data(), num_bytes);
-			total_bytes += num_bytes;
-			if(num_bytes < buffer.size()) {
-				break;
+		if(stripe_fds.empty()) {
+			send_range(fd, src, src_path, offset, file_size - offset, verify, 0);
+			total_bytes = file_size - offset;
+		} else {
+			std::vector<int> fds = {fd};
+			fds.insert(fds.end(), stripe_fds.begin(), stripe_fds.end());
+
+			std::vector<std::string> errors(fds.size());
+			std::vector<std::thread> threads;
+			for(size_t i = 0; i < fds.size(); ++i) {
+				threads.emplace_back([&, i]() {
+					uint64_t range_offset = 0;
+					uint64_t range_size = 0;
+					get_stripe_range(file_size, i, fds.size(), range_offset, range_size);
+					try {
+						send_range(fds[i], src, src_path, range_offset, range_size, verify, range_offset);
+					} catch(const std::exception& ex) {
+						errors[i] = ex.what();
+					}
+				});
 			}
-		}
-#else
-		const auto chunk_size = g_read_chunk_size * 1024;
-		while(true) {
-			const auto num_bytes = ::sendfile(fd, ::fileno(src), NULL, chunk_size);
-			if(num_bytes < 0) {
-				throw std::runtime_error("sendfile() failed with: " + get_socket_error_text());
-			}
-			total_bytes += num_bytes;
-			if(num_bytes < chunk_size) {
-				break;
+			for(auto& thread : threads) {
+				thread.join();
+			}
+			for(const auto& error : errors) {
+				if(!error.empty()) {
+					throw std::runtime_error(error);
+				}
 			}
+			total_bytes = file_size;
 		}
-		if(total_bytes != file_size) {
-			throw std::runtime_error("sendfile() failed with: remote EOF (" + std::to_string(total_bytes) + " / " + std::to_string(file_size) + ")");
+		if(capabilities & CAP_ACK) {
+			char status = 0;
+			recv_bytes(&status, fd, 1);
+			if(status != 1) {
+				throw std::runtime_error("destination failed to store file");
+			}
 		}
-#endif
 	} catch(...) {
+		for(const auto stripe_fd : stripe_fds) {
+			CLOSESOCKET(stripe_fd);
+		}
 		CLOSESOCKET(fd);
 		fclose(src);
 		throw;
 	}
-	CLOSESOCKET(fd);
+	for(const auto stripe_fd : stripe_fds) {
+		CLOSESOCKET(stripe_fd);
+	}
+	if((capabilities & CAP_SESSION) && (capabilities & CAP_ACK)) {
+		// keep the connection for the next file, saves the handshake and TCP slow start
+		std::lock_guard<std::mutex> lock(g_session_mutex);
+		g_sessions.push_back(fd);
+	} else {
+		CLOSESOCKET(fd);
+	}
 	fclose(src);
 
 	return total_bytes;
@@ -197,6 +590,12 @@ int main(int argc, char** argv) try
 		"d, delete", "Delete files after copy (default = false)", cxxopts::value<bool>(do_remove))(
 		"t, target", "Target hostname / IP address (default = localhost)", cxxopts::value<std::string>(target))(
 		"r, nthreads", "Number of threads (default = 10)", cxxopts::value<int>(threads))(
+		"protocol", "Protocol version, 1 = legacy for old sinks (default = 2)", cxxopts::value<int>(g_protocol))(
+		"checksum", "Send a hash of each file for the sink to verify, if supported, disable with --checksum=false (default = true)", cxxopts::value<bool>(g_checksum)->default_value("true"))(
+		"s, stripes", "Number of parallel connections per file, if supported by the sink (default = 1)", cxxopts::value<int>(g_num_stripes))(
+		"session", "Send multiple files over the same connection, if supported, disable with --session=false (default = true)", cxxopts::value<bool>(g_session)->default_value("true"))(
+		"retries", "Number of retries per file, resuming where the sink left off if supported (default = 3)", cxxopts::value<int>(g_num_retries))(
+		"retry-delay", "Delay before each retry [sec] (default = 10)", cxxopts::value<int>(g_retry_delay_sec))(
 		"f, files", "List of plot files", cxxopts::value<std::vector<std::string>>(file_list))(
 		"help", "Print help");
 
@@ -209,6 +608,11 @@ int main(int argc, char** argv) try
 		return 0;
 	}
 
+#ifndef _WIN32
+	std::signal(SIGPIPE, SIG_IGN);		// report sends on connections closed by the sink as errors instead
+#endif
+	const auto dst_addr = get_sockaddr_byname(target, port);
+
 	std::mutex mutex;
 
 #pragma omp parallel for num_threads(threads)
@@ -220,8 +624,9 @@ int main(int argc, char** argv) try
 			std::lock_guard<std::mutex> lock(mutex);
 			std::cout << "Starting to copy " << file_name << " ..." << std::endl;
 		}
+		for(int retry = 0; true; ++retry)
 		try {
-			const auto num_bytes = send_file(file_name, target, port);
+			const auto num_bytes = send_file(file_name, dst_addr);
 
 			const auto elapsed = (get_time_millis() - time_begin) / 1e3;
 			{
@@ -233,13 +638,27 @@ int main(int argc, char** argv) try
 			if(do_remove) {
 				std::remove(file_name.c_str());
 			}
+			break;
 		}
 		catch(const std::exception& ex) {
-			std::lock_guard<std::mutex> lock(mutex);
-			std::cout << "Failed to copy " << file_name << ": " << ex.what() << std::endl;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				std::cout << "Failed to copy " << file_name << ": " << ex.what();
+				if(retry < g_num_retries) {
+					std::cout << " (retry " << retry + 1 << " / " << g_num_retries << " in " << g_retry_delay_sec << " sec)";
+				}
+				std::cout << std::endl;
+			}
+			if(retry >= g_num_retries) {
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::seconds(g_retry_delay_sec));
 		}
 	}
-	
+
+	for(const auto fd : g_sessions) {
+		CLOSESOCKET(fd);
+	}
 #ifdef _WIN32
 	WSACleanup();
 #endif
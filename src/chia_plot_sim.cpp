@@ -0,0 +1,370 @@
+/*
+ * chia_plot_sim.cpp
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <cmath>
+#include <random>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <cxxopts.hpp>
+#include <drive_registry.hpp>
+#include <placement.hpp>
+
+
+static int g_num_drives = 500;
+static double g_min_capacity = 12;		// [TB]
+static double g_max_capacity = 20;		// [TB]
+static double g_min_speed = 120;		// [MB/s]
+static double g_max_speed = 280;		// [MB/s]
+static double g_inner_speed = 0.5;		// speed of a full drive relative to an empty one
+static double g_seek_penalty = 0.1;		// loss of total throughput per additional parallel copy
+static double g_plot_size = 101.4;		// [GiB]
+static double g_interval = 2;			// mean time between plot arrivals [sec]
+static int g_num_plots = 0;				// without trace, 0 = as many as fit
+static int g_max_num_active = 1;
+static int g_refresh_sec = 10;
+static unsigned g_seed = 1;
+
+
+struct virtual_drive_t {
+	std::string path;
+	uint64_t capacity = 0;		// [bytes]
+	uint64_t used = 0;			// [bytes]
+	double speed = 0;			// when empty [bytes/sec]
+};
+
+struct arrival_t {
+	double time = 0;			// [sec]
+	uint64_t num_bytes = 0;
+};
+
+struct copy_t {
+	size_t drive = 0;
+	uint64_t num_bytes = 0;
+	double remaining = 0;		// [bytes]
+	double time_begin = 0;
+};
+
+struct sim_result_t {
+	double fill_time = 0;			// last copy finished [sec]
+	double fill_time_90 = 0;		// 90% of total capacity used [sec]
+	double idle_time = 0;			// drive time not writing, while not full [sec]
+	double idle_wait_time = 0;		// same, while plots were waiting [sec]
+	double total_wait = 0;			// time plots spent waiting for a drive [sec]
+	double max_wait = 0;
+	uint64_t stranded = 0;			// free space on drives which cannot take another plot [bytes]
+	uint64_t unused = 0;			// free space on drives which still could [bytes]
+	size_t num_plots = 0;
+	size_t num_rejected = 0;
+};
+
+
+/*
+ * Virtual drives for DriveRegistry, each drive is its own device.
+ */
+class SimProvider : public DriveProvider {
+public:
+	SimProvider(std::vector<virtual_drive_t>& drives)
+		:	drives(drives)
+	{
+		for(size_t i = 0; i < drives.size(); ++i) {
+			index[drives[i].path] = i;
+		}
+	}
+
+	drive_status_t get_status(const std::string& path) override
+	{
+		const auto& drive = drives[index.at(path)];
+		drive_status_t out;
+		out.available = drive.capacity - drive.used;
+		out.is_valid = true;
+		return out;
+	}
+
+	block_device_t get_device(const std::string& path) override
+	{
+		block_device_t out;
+		out.name = path;
+		return out;
+	}
+
+private:
+	std::vector<virtual_drive_t>& drives;
+	std::map<std::string, size_t> index;
+
+};
+
+
+static
+std::vector<virtual_drive_t> create_drives()
+{
+	std::mt19937_64 rand(g_seed);
+	std::uniform_real_distribution<double> capacity(g_min_capacity, g_max_capacity);
+	std::uniform_real_distribution<double> speed(g_min_speed, g_max_speed);
+
+	std::vector<virtual_drive_t> out(g_num_drives);
+	for(size_t i = 0; i < out.size(); ++i) {
+		auto& drive = out[i];
+		drive.path = "vd" + std::to_string(i);
+		drive.capacity = capacity(rand) * 1e12;
+		drive.speed = speed(rand) * 1e6;
+	}
+	return out;
+}
+
+/*
+ * Reads "<arrival time [sec]> [size in bytes]" per line, '#' starts a comment.
+ */
+static
+std::vector<arrival_t> read_trace(const std::string& file_name)
+{
+	std::ifstream file(file_name);
+	if(!file) {
+		throw std::runtime_error("failed to open " + file_name);
+	}
+	std::vector<arrival_t> out;
+	std::string line;
+	while(std::getline(file, line)) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream in(line);
+		arrival_t entry;
+		if(!(in >> entry.time)) {
+			continue;
+		}
+		double size = 0;
+		entry.num_bytes = (in >> size) ? uint64_t(size) : uint64_t(g_plot_size * pow(1024, 3));
+		out.push_back(entry);
+	}
+	std::stable_sort(out.begin(), out.end(), [](const arrival_t& L, const arrival_t& R) -> bool {
+		return L.time < R.time;
+	});
+	return out;
+}
+
+/*
+ * Write throughput of one copy, given the number of copies on the same drive.
+ */
+static
+double get_copy_speed(const virtual_drive_t& drive, const size_t num_active)
+{
+	const auto fill = double(drive.used) / drive.capacity;
+	const auto total = drive.speed * (1 - (1 - g_inner_speed) * fill) / (1 + g_seek_penalty * (num_active - 1));
+	return total / num_active;
+}
+
+static
+sim_result_t simulate(const std::string& placement_name, const std::vector<arrival_t>& trace)
+{
+	auto drives = create_drives();
+	std::vector<std::string> paths;
+	const uint64_t plot_size = g_plot_size * pow(1024, 3);
+	uint64_t total_capacity = 0;
+	size_t num_slots = 0;
+	for(const auto& drive : drives) {
+		paths.push_back(drive.path);
+		total_capacity += drive.capacity;
+		num_slots += (drive.capacity - 4096) / plot_size;
+	}
+	const auto provider = std::make_shared<SimProvider>(drives);
+	DriveRegistry registry(paths, g_max_num_active, false, true, 0, nullptr, provider);
+	const auto placement = create_placement(placement_name);
+
+	std::mt19937_64 rand(g_seed);
+	std::exponential_distribution<double> interval(1 / g_interval);
+
+	sim_result_t out;
+	double now = 0;
+	double last_refresh = 0;
+	uint64_t total_used = 0;
+	size_t next_trace = 0;
+	const size_t num_arrivals = trace.empty() ? (g_num_plots > 0 ? g_num_plots : num_slots) : trace.size();
+	double next_arrival = trace.empty() ? interval(rand) : trace[0].time;
+	bool is_full = false;
+
+	std::deque<arrival_t> waiting;
+	std::vector<copy_t> active;
+	std::vector<size_t> num_active(drives.size());
+
+	while(true) {
+		// admit in order of arrival, as the sink does
+		while(!waiting.empty()) {
+			const auto entry = waiting.front();
+			const int index = registry.reserve(entry.num_bytes,
+				[&placement, &entry](const std::vector<drive_t>& list) -> int {
+					return placement->select(list, entry.num_bytes);
+				});
+			if(index < 0) {
+				break;
+			}
+			copy_t copy;
+			copy.drive = index;
+			copy.num_bytes = entry.num_bytes;
+			copy.remaining = entry.num_bytes;
+			copy.time_begin = now;
+			active.push_back(copy);
+			num_active[index]++;
+
+			const auto wait = now - entry.time;
+			out.total_wait += wait;
+			out.max_wait = std::max(out.max_wait, wait);
+			waiting.pop_front();
+		}
+		if(active.empty() && !waiting.empty()) {
+			// nothing will change anymore, no drive can take the next plot
+			is_full = true;
+		}
+		const bool has_arrival = !is_full && next_trace < num_arrivals;
+		if(active.empty() && !has_arrival) {
+			break;
+		}
+
+		// find next event
+		double time_next = has_arrival ? next_arrival : std::numeric_limits<double>::infinity();
+		for(const auto& copy : active) {
+			time_next = std::min(time_next, now + copy.remaining / get_copy_speed(drives[copy.drive], num_active[copy.drive]));
+		}
+		const auto delta = time_next - now;
+
+		for(size_t i = 0; i < drives.size(); ++i) {
+			if(!num_active[i] && drives[i].capacity - drives[i].used > plot_size) {
+				out.idle_time += delta;
+				if(!waiting.empty()) {
+					out.idle_wait_time += delta;
+				}
+			}
+		}
+		for(auto& copy : active) {
+			copy.remaining -= delta * get_copy_speed(drives[copy.drive], num_active[copy.drive]);
+		}
+		now = time_next;
+
+		// finish copies
+		for(auto iter = active.begin(); iter != active.end();) {
+			if(iter->remaining > 1) {
+				++iter;
+				continue;
+			}
+			auto& drive = drives[iter->drive];
+			drive.used += iter->num_bytes;
+			total_used += iter->num_bytes;
+			num_active[iter->drive]--;
+			registry.release(iter->drive, iter->num_bytes, true);
+			registry.add_result(iter->drive, iter->num_bytes, now - iter->time_begin, 0);
+			out.num_plots++;
+			if(!out.fill_time_90 && total_used >= 0.9 * total_capacity) {
+				out.fill_time_90 = now;
+			}
+			out.fill_time = now;
+			iter = active.erase(iter);
+		}
+
+		// new arrivals
+		while(has_arrival && next_arrival <= now) {
+			if(trace.empty()) {
+				waiting.push_back(arrival_t{next_arrival, plot_size});
+				next_arrival += interval(rand);
+				next_trace++;
+				break;
+			}
+			waiting.push_back(trace[next_trace++]);
+			next_arrival = next_trace < trace.size() ? trace[next_trace].time : std::numeric_limits<double>::infinity();
+		}
+
+		if(g_refresh_sec > 0 && now - last_refresh >= g_refresh_sec) {
+			registry.refresh();
+			last_refresh = now;
+		}
+	}
+	out.num_rejected = waiting.size() + (num_arrivals - next_trace);
+
+	for(const auto& drive : drives) {
+		const auto free = drive.capacity - drive.used;
+		(free > plot_size + 4096 ? out.unused : out.stranded) += free;
+	}
+	return out;
+}
+
+
+int main(int argc, char** argv) try
+{
+	cxxopts::Options options("chia_plot_sim",
+		"Simulates plot placement on virtual drives, to compare placement policies at scale.\n\n"
+		"Usage: chia_plot_sim -n 500 --placement most-free,eta\n"
+	);
+
+	std::string placement_list = "most-free,round-robin,fill-first,lru,throughput,eta";
+	std::string trace_file;
+
+	options.allow_unrecognised_options().add_options()(
+		"n, drives", "Number of virtual drives (default = 500)", cxxopts::value<int>(g_num_drives))(
+		"min-capacity", "Minimum drive capacity [TB] (default = 12)", cxxopts::value<double>(g_min_capacity))(
+		"max-capacity", "Maximum drive capacity [TB] (default = 20)", cxxopts::value<double>(g_max_capacity))(
+		"min-speed", "Minimum drive write speed when empty [MB/s] (default = 120)", cxxopts::value<double>(g_min_speed))(
+		"max-speed", "Maximum drive write speed when empty [MB/s] (default = 280)", cxxopts::value<double>(g_max_speed))(
+		"inner-speed", "Write speed of a full drive relative to an empty one (default = 0.5)", cxxopts::value<double>(g_inner_speed))(
+		"seek-penalty", "Loss of drive throughput per additional parallel copy (default = 0.1)", cxxopts::value<double>(g_seek_penalty))(
+		"s, plot-size", "Plot size [GiB] (default = 101.4)", cxxopts::value<double>(g_plot_size))(
+		"i, interval", "Mean time between plot arrivals [sec], without trace (default = 2)", cxxopts::value<double>(g_interval))(
+		"p, plots", "Number of plots to arrive, without trace (default = as many as fit)", cxxopts::value<int>(g_num_plots))(
+		"t, trace", "Arrival trace, one '<time [sec]> [size in bytes]' per line", cxxopts::value<std::string>(trace_file))(
+		"r, parallel", "Max number of parallel copies per drive (default = 1)", cxxopts::value<int>(g_max_num_active))(
+		"refresh-interval", "Interval to refresh free space [sec] (default = 10)", cxxopts::value<int>(g_refresh_sec))(
+		"placement", "Placement policies to compare (default = all)", cxxopts::value<std::string>(placement_list))(
+		"seed", "Random seed for drives and arrivals (default = 1)", cxxopts::value<unsigned>(g_seed))(
+		"help", "Print help");
+
+	const auto args = options.parse(argc, argv);
+
+	if(args.count("help")) {
+		std::cout << options.help({""}) << std::endl;
+		return 0;
+	}
+	if(g_num_drives <= 0 || g_interval <= 0 || g_plot_size <= 0) {
+		throw std::logic_error("invalid arguments");
+	}
+	const auto trace = trace_file.empty() ? std::vector<arrival_t>() : read_trace(trace_file);
+
+	std::cout << "Drives: " << g_num_drives << " x " << g_min_capacity << " - " << g_max_capacity << " TB, "
+			<< g_min_speed << " - " << g_max_speed << " MB/s, " << g_max_num_active << " parallel copies" << std::endl;
+	if(trace.empty()) {
+		std::cout << "Arrivals: one " << g_plot_size << " GiB plot every " << g_interval << " sec on average, "
+				<< (g_num_plots > 0 ? std::to_string(g_num_plots) + " plots" : std::string("until full")) << std::endl;
+	} else {
+		std::cout << "Arrivals: " << trace.size() << " plots from " << trace_file << std::endl;
+	}
+
+	std::istringstream in(placement_list);
+	std::string name;
+	while(std::getline(in, name, ',')) {
+		const auto res = simulate(name, trace);
+		std::cout << name << ": " << res.num_plots << " plots";
+		if(res.num_rejected) {
+			std::cout << " (" << res.num_rejected << " rejected)";
+		}
+		std::cout << ", fill time " << res.fill_time / 3600 << " h";
+		if(res.fill_time_90 > 0) {
+			std::cout << " (90% at " << res.fill_time_90 / 3600 << " h)";
+		}
+		std::cout << ", idle " << res.idle_time / 3600 << " drive-h (" << res.idle_wait_time / 3600 << " while plots waiting)"
+				<< ", wait avg " << (res.num_plots ? res.total_wait / res.num_plots : 0) << " sec max " << res.max_wait << " sec"
+				<< ", stranded " << res.stranded / pow(1024, 4) << " TiB";
+		if(res.unused) {
+			std::cout << ", unused " << res.unused / pow(1024, 4) << " TiB";
+		}
+		std::cout << std::endl;
+	}
+	return 0;
+}
+catch(const std::exception& ex) {
+	std::cerr << "Failed with: " << ex.what() << std::endl;
+	return -1;
+}
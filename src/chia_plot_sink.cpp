@@ -14,21 +14,41 @@
 #include <thread>
 #include <map>
 #include <set>
+#include <deque>
 #include <chrono>
 #include <csignal>
 #include <cmath>
 #include <random>
 #include <algorithm>
 #include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <sstream>
 
 #define _SILENCE_EXPERIMENTAL_FILESYSTEM_DEPRECATION_WARNING
 #include <experimental/filesystem>
 
 #include <cxxopts.hpp>
 #include <stdiox.hpp>
+#include <file_writer.hpp>
+#include <buffer_pool.hpp>
+#include <drive_writer.hpp>
+#include <drive_registry.hpp>
+#include <placement.hpp>
+#include <metrics.hpp>
+#include <async_logger.hpp>
+#include <poller.hpp>
+#include <protocol.hpp>
+#include <xxhash64.hpp>
+
+#ifdef HAVE_IO_URING
+#include <uring_engine.hpp>
+#endif
 
 #ifndef _WIN32
 #include <poll.h>
+#include <glob.h>
+#include <arpa/inet.h>
 #endif
 
 
@@ -38,13 +58,191 @@ static int g_server = -1;
 static bool g_do_run = true;
 static bool g_force_shutdown = false;
 static int g_recv_timeout_sec = 100;
+static int g_handshake_timeout_sec = 30;
+static int g_max_num_active = 1;
+static int g_refresh_sec = 10;
+static bool g_adaptive = false;
+static bool g_group_devices = true;
+static int g_controller_limit = 0;
+static std::string g_config_file;
+static std::vector<std::string> g_dest_args;
+static bool g_watch_mounts = false;
+static volatile std::sig_atomic_t g_reload = 0;
+static int g_metrics_port = 0;
+static uint64_t g_capabilities = CAP_ACK | CAP_RESUME | CAP_CHECKSUM | CAP_STRIPE | CAP_SESSION;		// offered to version 2 clients
+static int g_max_stripes = 16;
+static int g_session_timeout_sec = 600;
+static const uint64_t g_resume_align = 1024 * 1024;		// partial files are resumed at a multiple of this
+static int g_partial_max_age_hours = 24;
+static std::string g_admission = "fifo";
+static std::string g_placement_name = "most-free";
+static const size_t g_max_overtake = 16;
+static int g_wakeup_fd[2] = {-1, -1};
+static bool g_use_splice = false;
+static bool g_direct_io = false;
+static bool g_preallocate = true;
+static int g_pipeline_depth = 0;
+static const size_t g_buffer_size = 1024 * 1024;
+static std::string g_engine = "thread";
+static int g_queue_depth = 4;
+static int g_num_loops = 1;
+static bool g_drive_writers = false;
+
+struct drive_stats_t {
+	size_t num_jobs = 0;
+	uint64_t num_bytes = 0;
+	double total_sec = 0;
+	double reader_starved_sec = 0;		// network stage waiting for free buffers (disk bound)
+	double writer_starved_sec = 0;		// disk stage waiting for data (network bound)
+};
 
 static std::mutex g_mutex;
+static AsyncLogger g_log;		// never blocks, so it's safe to use while holding g_mutex
 static std::condition_variable g_signal;
 static std::map<uint64_t, std::shared_ptr<std::thread>> g_threads;
-static std::map<std::string, uint64_t> g_reserved;
-static std::map<std::string, int64_t> g_num_active;
-static std::set<std::string> g_failed_drives;
+static std::map<std::string, drive_stats_t> g_drive_stats;
+static std::shared_ptr<BufferPool> g_pool;
+static std::map<std::string, std::shared_ptr<DriveWriter>> g_writers;		// by device
+static std::map<std::string, std::shared_ptr<RateLimiter>> g_limiters;		// by controller
+static std::shared_ptr<DriveRegistry> g_drives;
+static std::shared_ptr<PlacementPolicy> g_placement;
+
+/*
+ * Identity of a copy for CAP_RESUME, `offset` is where it continues.
+ */
+struct transfer_t {
+	uint64_t id = 0;
+	uint64_t offset = 0;
+	bool is_resumable = false;		// keep partial file on failure
+	uint64_t num_allocated = 0;		// bytes preallocated, see DriveRegistry::allocate()
+};
+
+/*
+ * Partial file of an interrupted copy, kept as "<file>.tmp" next to a "<file>.resume" marker.
+ */
+struct partial_t {
+	std::string dst_path;
+	std::string file_name;
+	uint64_t file_size = 0;
+	uint64_t offset = 0;			// bytes on disk, multiple of g_resume_align
+	int64_t time_kept = 0;			// when it was kept or last matched [sec], see get_file_time()
+	bool is_active = false;			// being resumed right now
+};
+
+static std::map<uint64_t, partial_t> g_partials;		// by transfer id
+static std::vector<int> g_idle_sessions;
+static std::map<std::string, uint64_t> g_dest_devices;		// device id of each destination when it was added, by path		// connections handed back by finished copies (CAP_SESSION)
+
+struct sink_metrics_t {
+	Counter received_bytes;
+	Counter copies_ok;
+	Counter copies_failed;
+	Counter handshakes_failed;
+	Gauge active_copies;
+	Gauge waiting_clients;
+	Gauge pending_handshakes;
+	Histogram copy_duration {{10, 30, 60, 120, 300, 600, 1200, 1800, 3600}};					// [sec]
+	Histogram copy_throughput {{10, 25, 50, 100, 150, 200, 300, 500, 1000, 2000}};			// [MB/s]
+	Histogram recv_wait {{1e-4, 5e-4, 1e-3, 5e-3, 0.01, 0.05, 0.1, 0.5, 1, 5}};				// [sec]
+	Histogram recv_size {{4, 16, 64, 256, 1024, 4096}};						// [KiB]
+	Histogram write_latency {{1e-4, 5e-4, 1e-3, 5e-3, 0.01, 0.05, 0.1, 0.5, 1, 5}};			// [sec]
+};
+
+static sink_metrics_t g_metrics;
+
+/*
+ * Time spent per phase of one copy, to tell whether it was limited by network or disk.
+ */
+struct job_phases_t {
+	typedef std::chrono::steady_clock clock_type;
+
+	Histogram recv_wait {{1e-4, 5e-4, 1e-3, 5e-3, 0.01, 0.05, 0.1, 0.5, 1, 5}};		// waiting for data [sec]
+	Histogram recv_size {{4, 16, 64, 256, 1024, 4096}};		// per recv() [KiB]
+	Histogram write_latency {{1e-4, 5e-4, 1e-3, 5e-3, 0.01, 0.05, 0.1, 0.5, 1, 5}};	// per write [sec]
+
+	static double elapsed(const clock_type::time_point& begin) {
+		return std::chrono::duration<double>(clock_type::now() - begin).count();
+	}
+
+	void add_wait(const double sec) {
+		recv_wait.observe(sec);
+		g_metrics.recv_wait.observe(sec);
+	}
+
+	void add_recv(const size_t num_bytes) {
+		recv_size.observe(num_bytes / 1024.);
+		g_metrics.recv_size.observe(num_bytes / 1024.);
+	}
+
+	void add_write(const double sec) {
+		write_latency.observe(sec);
+		g_metrics.write_latency.observe(sec);
+	}
+
+	/*
+	 * Compares total time waiting for the network with total time blocked in writes.
+	 */
+	std::string get_bottleneck() const
+	{
+		const auto wait_sec = recv_wait.get_sum();
+		const auto write_sec = write_latency.get_sum();
+		if(std::max(wait_sec, write_sec) < 1.2 * std::min(wait_sec, write_sec)) {
+			return "balanced";
+		}
+		return write_sec > wait_sec ? "disk bound" : "network bound";
+	}
+
+	std::string to_string() const
+	{
+		std::ostringstream out;
+		out.precision(3);
+		out << "recv wait " << recv_wait.get_sum() << " sec (p50 " << recv_wait.get_quantile(0.5) * 1e3
+			<< " ms, p99 " << recv_wait.get_quantile(0.99) * 1e3 << " ms), "
+			<< recv_size.get_count() << " recv avg " << uint64_t(recv_size.get_count() ? recv_size.get_sum() / recv_size.get_count() : 0) << " KiB, "
+			<< "write " << write_latency.get_sum() << " sec (p50 " << write_latency.get_quantile(0.5) * 1e3
+			<< " ms, p99 " << write_latency.get_quantile(0.99) * 1e3 << " ms) -> " << get_bottleneck();
+		return out.str();
+	}
+};
+
+enum client_phase_e {
+	PHASE_SIZE,			// receiving file size, or protocol magic
+	PHASE_HELLO,		// receiving rest of version 2 header
+	PHASE_WAIT,			// waiting for a drive
+	PHASE_NAME_LEN,		// receiving file name length
+	PHASE_NAME,			// receiving file name
+	PHASE_TRANSFER_ID,	// receiving version 2 transfer id (CAP_RESUME)
+	PHASE_STRIPE,		// receiving version 2 stripe header (CAP_STRIPE)
+};
+
+struct client_t {
+	int fd = -1;
+	std::string address;
+	client_phase_e phase = PHASE_SIZE;
+	std::vector<char> buffer;
+	size_t offset = 0;
+	int64_t deadline = 0;
+	uint64_t file_size = 0;
+	size_t wait_counter = 0;
+	size_t num_overtaken = 0;			// number of later clients admitted first
+	int64_t wait_begin = 0;
+	int drive = -1;						// reserved destination
+	std::string dst_path;
+	uint16_t version = 1;				// negotiated protocol version
+	uint64_t capabilities = 0;			// negotiated capabilities
+	uint64_t offered = 0;				// capabilities offered by client
+	std::string file_name;				// version 2 sends it before waiting
+	transfer_t transfer;
+	uint64_t stripe_id = 0;
+	uint16_t stripe_index = 0;
+	uint16_t num_stripes = 1;			// > 1 if striping was negotiated
+	std::vector<std::shared_ptr<client_t>> stripes;		// other stripes, if this is stripe 0
+	bool is_session = false;			// connection carried a previous copy (CAP_SESSION)
+};
+
+#ifdef HAVE_IO_URING
+static std::shared_ptr<UringEngine> g_uring;
+#endif
 
 
 inline
@@ -63,6 +261,15 @@ std::string get_socket_error_text() {
 }
 #endif
 
+inline
+bool is_socket_would_block() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
 inline
 ::sockaddr_in get_sockaddr_byname(const std::string& endpoint, int port)
 {
@@ -79,22 +286,55 @@ inline
 }
 
 inline
-void set_socket_nonblocking(int fd)
+void set_socket_nonblocking(int fd, const bool enable = true)
 {
 #ifdef _WIN32
-	u_long mode = 1;
+	u_long mode = enable ? 1 : 0;
 	const auto res = ::ioctlsocket(fd, FIONBIO, &mode);
 	if(res != 0){
 		throw std::runtime_error("ioctlsocket() failed with: " + get_socket_error_text());
 	}
 #else
-	const auto res = ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	const auto flags = ::fcntl(fd, F_GETFL, 0);
+	const auto res = ::fcntl(fd, F_SETFL, enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
 	if(res < 0) {
 		throw std::runtime_error("fcntl() failed with: " + get_socket_error_text());
 	}
 #endif
 }
 
+/*
+ * Enables TCP keepalive, so peers which vanished without closing the connection are detected
+ * while waiting for a drive.
+ */
+inline
+void set_socket_keepalive(int fd)
+{
+	int enable = 1;
+	if(::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char*)&enable, sizeof(enable)) < 0) {
+		throw std::runtime_error("setsockopt(SO_KEEPALIVE) failed with: " + get_socket_error_text());
+	}
+#ifdef TCP_KEEPIDLE
+	int idle_sec = 30;
+	int interval_sec = 10;
+	int count = 3;
+	::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (const char*)&idle_sec, sizeof(idle_sec));
+	::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (const char*)&interval_sec, sizeof(interval_sec));
+	::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (const char*)&count, sizeof(count));
+#endif
+}
+
+inline
+std::string get_peer_address(int fd)
+{
+	::sockaddr_in addr = {};
+	::socklen_t addr_len = sizeof(addr);
+	if(::getpeername(fd, (::sockaddr*)&addr, &addr_len) < 0) {
+		return "unknown";
+	}
+	return std::string(::inet_ntoa(addr.sin_addr)) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
 inline
 int poll_fd_ex(const int fd, const int events, const int timeout_ms)
 {
@@ -115,14 +355,23 @@ int poll_fd_ex(const int fd, const int events, const int timeout_ms)
 	return ret;
 }
 
+/*
+ * Receives exactly `num_bytes`, waiting at most `timeout_ms` for each part if the socket is non-blocking.
+ */
 inline
-void recv_bytes(void* dst, const int fd, const size_t num_bytes)
+void recv_bytes(void* dst, const int fd, const size_t num_bytes, const int timeout_ms = -1)
 {
 	auto num_left = num_bytes;
 	auto* dst_= (char*)dst;
 	while(num_left > 0) {
+		if(timeout_ms >= 0 && !poll_fd_ex(fd, POLLIN, timeout_ms)) {
+			throw std::runtime_error("recv() failed with: timeout");
+		}
 		const auto num_read = ::recv(fd, dst_, num_left, 0);
 		if(num_read < 0) {
+			if(timeout_ms >= 0 && is_socket_would_block()) {
+				continue;
+			}
 			throw std::runtime_error("recv() failed with: " + std::string(strerror(errno)));
 		} else if(num_read == 0) {
 			throw std::runtime_error("recv() failed with: EOF");
@@ -158,72 +407,451 @@ void trigger_shutdown(int sig)
 	CLOSESOCKET(sock);
 }
 
+/*
+ * Wakes up the main loop, ie. to assign drives to waiting clients after a copy finished.
+ */
 static
-void copy_func(const uint64_t job, const int fd, const uint64_t num_bytes, const std::string& dst_path, const std::string& file_name)
+void wakeup_main()
 {
-	const auto file_path = dst_path + (!dst_path.empty() && dst_path.back() != '/' ? "/" : "") + file_name;
-	const auto tmp_file_path = file_path + ".tmp";
-
-	bool is_drive_fail = false;
-	auto* file = fopen(tmp_file_path.c_str(), "wb");
-	if(file) {
-		std::lock_guard<std::mutex> lock(g_mutex);
-		std::cout << "Started copy to " << file_path << " (" << float(num_bytes / pow(1024, 3)) << " GiB)" << std::endl;
-	} else {
-		std::lock_guard<std::mutex> lock(g_mutex);
-		std::cerr << "fopen('" << tmp_file_path << "') failed with: " << strerror(errno) << std::endl;
-		is_drive_fail = true;
+#ifndef _WIN32
+	const char dummy = 0;
+	if(::write(g_wakeup_fd[1], &dummy, 1) < 0) {
+		// pipe full, main loop is awake anyway
 	}
-	const auto time_begin = get_time_millis();
+#endif
+	g_signal.notify_all();
+}
 
-	uint64_t num_left = num_bytes;
-	std::vector<char> buffer(1024 * 1024);
+#ifdef SIGHUP
+static
+void trigger_reload(int)
+{
+	g_reload = 1;
+	const char dummy = 0;
+	if(::write(g_wakeup_fd[1], &dummy, 1) < 0) {
+		// ignore
+	}
+}
+#endif
 
-	set_socket_nonblocking(fd);
+#ifdef __linux__
+/*
+ * Receives data via socket -> pipe -> file using splice(), without copying it through user space.
+ * Returns false if splice() into the file is not supported, in which case any data already received
+ * has been written and the caller should continue with the regular recv() loop.
+ */
+static
+bool splice_recv(	const int fd, const int file_fd, uint64_t& num_left, bool& is_drive_fail, const std::string& tmp_file_path,
+					job_phases_t& phases)
+{
+	int pipe_fd[2] = {-1, -1};
+	if(::pipe(pipe_fd)) {
+		g_log.error() << "pipe() failed with: " << strerror(errno);
+		return false;
+	}
+	const auto pipe_size = std::max(::fcntl(pipe_fd[1], F_SETPIPE_SZ, 1024 * 1024), ::fcntl(pipe_fd[1], F_GETPIPE_SZ));
 
-	while(file && num_left)
+	bool is_supported = true;
+	while(num_left)
 	{
+		const auto time_wait = job_phases_t::clock_type::now();
 		if(!poll_fd_ex(fd, POLLIN, g_recv_timeout_sec * 1000))
 		{
-			std::lock_guard<std::mutex> lock(g_mutex);
-			std::cerr << "recv() failed with: timeout" << std::endl;
+			g_log.error() << "splice() failed with: timeout";
 			break;
 		}
-		const auto num_read = ::recv(fd, buffer.data(), std::min<uint64_t>(num_left, buffer.size()), 0);
+		phases.add_wait(job_phases_t::elapsed(time_wait));
+
+		const auto num_read = ::splice(fd, NULL, pipe_fd[1], NULL,
+				std::min<uint64_t>(num_left, pipe_size), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 		if(num_read < 0) {
-			std::lock_guard<std::mutex> lock(g_mutex);
-			std::cerr << "recv() failed with: " << strerror(errno) << std::endl;
+			if(errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			g_log.error() << "splice() failed with: " << strerror(errno);
 			break;
 		} else if(num_read == 0) {
-			std::lock_guard<std::mutex> lock(g_mutex);
-			std::cerr << "recv() failed with: EOF" << std::endl;
+			g_log.error() << "splice() failed with: EOF";
+			break;
+		}
+		phases.add_recv(num_read);
+
+		const auto time_write = job_phases_t::clock_type::now();
+		auto pending = num_read;
+		while(pending > 0) {
+			const auto num_written = ::splice(pipe_fd[0], NULL, file_fd, NULL, pending, SPLICE_F_MOVE);
+			if(num_written > 0) {
+				pending -= num_written;
+			} else if(num_written < 0 && errno == EINTR) {
+				continue;
+			} else {
+				break;
+			}
+		}
+		phases.add_write(job_phases_t::elapsed(time_write));
+
+		if(pending && num_read == pending && (errno == EINVAL || errno == ENOSYS)) {
+			// file system does not support splice(), write what is left in the pipe and fall back to recv()
+			is_supported = false;
+			std::vector<char> buffer(pending);
+			while(pending > 0) {
+				const auto num_drained = ::read(pipe_fd[0], buffer.data(), pending);
+				if(num_drained < 0 && errno == EINTR) {
+					continue;
+				}
+				if(num_drained <= 0) {
+					break;
+				}
+				ssize_t num_written = 0;
+				while(num_written < num_drained) {
+					const auto ret = ::write(file_fd, buffer.data() + num_written, num_drained - num_written);
+					if(ret < 0 && errno == EINTR) {
+						continue;
+					}
+					if(ret <= 0) {
+						break;
+					}
+					num_written += ret;
+				}
+				if(num_written < num_drained) {
+					break;
+				}
+				pending -= num_drained;
+			}
+		}
+		if(pending) {
+			g_log.error() << "splice('" << tmp_file_path << "') failed with: " << strerror(errno);
+			is_drive_fail = true;
+			is_supported = true;
 			break;
 		}
 		num_left -= num_read;
+		g_metrics.received_bytes.add(num_read);
+
+		if(!is_supported) {
+			break;
+		}
+	}
+	::close(pipe_fd[0]);
+	::close(pipe_fd[1]);
+
+	if(!is_supported) {
+		g_log.info() << "splice() not supported for " << tmp_file_path << ", falling back to recv()";
+	}
+	return is_supported;
+}
+#endif
+
+/*
+ * Receives data in the calling thread while a separate writer thread writes it to disk.
+ * Both stages are connected by a bounded ring of the given buffers.
+ * If `drive` is given, its shared writer thread is used instead of a dedicated one.
+ * If `hasher` is given, the writer stage feeds it all data in order, to keep hashing off the recv() path.
+ */
+static
+void pipeline_recv(	const int fd, FileWriter& file, const std::vector<buffer_t>& buffers, DriveWriter* drive,
+					uint64_t& num_left, bool& is_drive_fail, drive_stats_t& stats, job_phases_t& phases, XXHash64* hasher)
+{
+	BufferRing<buffer_t> free_ring(buffers.size());
+	BufferRing<buffer_t> full_ring(buffers.size());
+	for(const auto& buf : buffers) {
+		free_ring.push(buf);
+	}
+	std::mutex write_mutex;
+	std::string write_error;
+	uint64_t num_written = 0;
+
+	std::thread writer;
+	if(!drive) {
+		writer = std::thread([&]() {
+			buffer_t buf;
+			while(full_ring.pop(buf)) {
+				const auto time_write = job_phases_t::clock_type::now();
+				try {
+					file.write(buf.data, buf.size);
+					phases.add_write(job_phases_t::elapsed(time_write));
+				} catch(const std::exception& ex) {
+					std::lock_guard<std::mutex> lock(write_mutex);
+					write_error = ex.what();
+					free_ring.close();
+					break;
+				}
+				if(hasher) {
+					hasher->update(buf.data, buf.size);
+				}
+				num_written += buf.size;
+				free_ring.push(buf);
+			}
+		});
+	}
 
-		if(fwrite(buffer.data(), 1, num_read, file) != num_read)
+	size_t num_held = 0;
+	uint64_t num_received = 0;
+	const uint64_t num_bytes = num_left;
+	while(num_received < num_bytes)
+	{
+		buffer_t buf;
+		if(!free_ring.pop(buf)) {
+			break;
+		}
+		num_held = 1;
 		{
-			std::lock_guard<std::mutex> lock(g_mutex);
-			std::cerr << "fwrite('" << tmp_file_path << "') failed with: " << strerror(errno) << std::endl;
-			is_drive_fail = true;
+			std::lock_guard<std::mutex> lock(write_mutex);
+			if(!write_error.empty()) {
+				break;
+			}
+		}
+		const auto time_wait = job_phases_t::clock_type::now();
+		if(!poll_fd_ex(fd, POLLIN, g_recv_timeout_sec * 1000))
+		{
+			g_log.error() << "recv() failed with: timeout";
+			break;
+		}
+		phases.add_wait(job_phases_t::elapsed(time_wait));
+
+		const auto num_read = ::recv(fd, buf.data, std::min<uint64_t>(num_bytes - num_received, buf.capacity), 0);
+		if(num_read < 0) {
+			g_log.error() << "recv() failed with: " << strerror(errno);
+			break;
+		} else if(num_read == 0) {
+			g_log.error() << "recv() failed with: EOF";
+			break;
+		}
+		buf.size = num_read;
+		num_received += num_read;
+		g_metrics.received_bytes.add(num_read);
+		phases.add_recv(num_read);
+		num_held = 0;
+
+		if(drive) {
+			drive->write(&file, buf, [&, buf](const std::string& error, const double write_sec) {
+				// called in order for the same file
+				if(hasher && error.empty()) {
+					hasher->update(buf.data, buf.size);
+				}
+				{
+					std::lock_guard<std::mutex> lock(write_mutex);
+					if(error.empty()) {
+						num_written += buf.size;
+						phases.add_write(write_sec);
+					} else if(write_error.empty()) {
+						write_error = error;
+					}
+				}
+				free_ring.push(buf);
+			});
+		} else if(!full_ring.push(buf)) {
 			break;
 		}
 	}
-	CLOSESOCKET(fd);
+	stats.reader_starved_sec = free_ring.get_wait_time();
 
-	if(file && fclose(file)) {
-		std::lock_guard<std::mutex> lock(g_mutex);
-		std::cerr << "fclose('" << tmp_file_path << "') failed with: " << strerror(errno) << std::endl;
+	if(drive) {
+		// wait for all buffers to come back from the drive writer
+		buffer_t buf;
+		for(size_t i = num_held; i < buffers.size(); ++i) {
+			free_ring.pop(buf);
+		}
+	} else {
+		full_ring.close();
+		writer.join();
+		stats.writer_starved_sec = full_ring.get_wait_time();
+	}
+
+	if(!write_error.empty()) {
+		g_log.error() << write_error;
 		is_drive_fail = true;
 	}
+	num_left = num_bytes - num_written;
+}
+
+static
+std::string get_file_path(const std::string& dst_path, const std::string& file_name) {
+	return dst_path + (!dst_path.empty() && dst_path.back() != '/' ? "/" : "") + file_name;
+}
+
+/*
+ * Returns the current time on the clock of file modification times [sec].
+ */
+static
+int64_t get_file_time() {
+	const auto now = std::experimental::filesystem::file_time_type::clock::now();
+	return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+}
+
+/*
+ * Deletes a partial file and its marker, caller must hold g_mutex.
+ */
+static
+void discard_partial(const uint64_t transfer_id)
+{
+	auto iter = g_partials.find(transfer_id);
+	if(iter != g_partials.end()) {
+		const auto file_path = get_file_path(iter->second.dst_path, iter->second.file_name);
+		std::remove((file_path + ".resume").c_str());
+		std::remove((file_path + ".tmp").c_str());
+		g_log.info() << "Discarded partial " << file_path << ".tmp";
+		g_partials.erase(iter);
+	}
+}
+
+/*
+ * Keeps the tmp file of an interrupted copy so the client can resume it.
+ * Returns the offset to resume at, 0 if nothing was kept.
+ */
+static
+uint64_t keep_partial(	const transfer_t& transfer, const std::string& dst_path, const std::string& file_name,
+						const uint64_t file_size, const uint64_t num_written)
+{
+	const auto file_path = get_file_path(dst_path, file_name);
+	const auto tmp_file_path = file_path + ".tmp";
+	const auto offset = (num_written / g_resume_align) * g_resume_align;
+	if(!offset) {
+		return 0;
+	}
+#ifndef _WIN32
+	// only offer what is on disk, the sink might crash before the client comes back
+	const int fd = ::open(tmp_file_path.c_str(), O_WRONLY);
+	if(fd < 0 || ::fdatasync(fd)) {
+		g_log.error() << "fdatasync('" << tmp_file_path << "') failed with: " << strerror(errno);
+		if(fd >= 0) {
+			::close(fd);
+		}
+		return 0;
+	}
+	::close(fd);
+#endif
+	{
+		std::ofstream marker(file_path + ".resume");
+		marker << transfer.id << " " << file_size << " " << offset << std::endl;
+		if(!marker) {
+			g_log.error() << "Failed to write " << file_path << ".resume";
+			return 0;
+		}
+	}
+	std::lock_guard<std::mutex> lock(g_mutex);
+	auto& partial = g_partials[transfer.id];
+	partial.dst_path = dst_path;
+	partial.file_name = file_name;
+	partial.file_size = file_size;
+	partial.offset = offset;
+	partial.time_kept = get_file_time();
+	partial.is_active = false;
+	return offset;
+}
+
+/*
+ * Indexes partial files left in `dst_path` by a previous run.
+ */
+static
+void load_partials(const std::string& dst_path)
+{
+	namespace fs = std::experimental::filesystem;
+	const std::string suffix = ".resume";
+	try {
+		for(const auto& entry : fs::directory_iterator(dst_path)) {
+			const auto name = entry.path().filename().string();
+			if(name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix)) {
+				continue;
+			}
+			const auto file_name = name.substr(0, name.size() - suffix.size());
+			const auto tmp_file_path = get_file_path(dst_path, file_name) + ".tmp";
+
+			partial_t partial;
+			uint64_t transfer_id = 0;
+			std::ifstream marker(entry.path().string());
+			if(!(marker >> transfer_id >> partial.file_size >> partial.offset)
+				|| !fs::exists(tmp_file_path) || fs::file_size(tmp_file_path) < partial.offset)
+			{
+				g_log.error() << "Ignoring invalid partial " << tmp_file_path;
+				continue;
+			}
+			partial.dst_path = dst_path;
+			partial.file_name = file_name;
+			partial.time_kept = std::chrono::duration_cast<std::chrono::seconds>(
+					fs::last_write_time(entry.path()).time_since_epoch()).count();
+			g_log.info() << "Found partial " << tmp_file_path << " (" << float(partial.offset / pow(1024, 3))
+					<< " of " << float(partial.file_size / pow(1024, 3)) << " GiB)";
+
+			std::lock_guard<std::mutex> lock(g_mutex);
+			g_partials[transfer_id] = partial;
+		}
+	} catch(const std::exception& ex) {
+		g_log.error() << "Failed to scan " << dst_path << " for partial files: " << ex.what();
+	}
+}
+
+/*
+ * Deletes partial files which were not resumed within g_partial_max_age_hours, so they don't hold on to their space forever.
+ */
+static
+void expire_partials()
+{
+	if(g_partial_max_age_hours <= 0) {
+		return;
+	}
+	const auto time_limit = get_file_time() - int64_t(g_partial_max_age_hours) * 3600;
+
+	std::lock_guard<std::mutex> lock(g_mutex);
+	std::vector<uint64_t> list;
+	for(const auto& entry : g_partials) {
+		if(!entry.second.is_active && entry.second.time_kept < time_limit) {
+			list.push_back(entry.first);
+		}
+	}
+	for(const auto transfer_id : list) {
+		discard_partial(transfer_id);
+	}
+}
+
+static
+void finish_copy(	const uint64_t job, const size_t drive, const uint64_t num_bytes, const std::string& dst_path, const std::string& file_path,
+					const int64_t time_begin, const double active_time_begin, const uint64_t num_left, const bool is_drive_fail,
+					const std::string& mode, const drive_stats_t& job_stats = drive_stats_t(), const job_phases_t* phases = nullptr,
+					const int ack_fd = -1, const transfer_t& transfer = transfer_t(), const bool keep_session = false)
+{
+	const auto tmp_file_path = file_path + ".tmp";
+
+	bool is_stored = false;
 	if(num_left) {
-		std::remove(tmp_file_path.c_str());
-		std::lock_guard<std::mutex> lock(g_mutex);
-		std::cerr << "Deleted " << tmp_file_path << std::endl;
+		uint64_t offset = 0;
+		if(transfer.is_resumable && !is_drive_fail) {
+			const auto file_name = file_path.substr(get_file_path(dst_path, "").size());
+			offset = keep_partial(transfer, dst_path, file_name, num_bytes, num_bytes - num_left);
+		}
+		if(offset) {
+			g_log.error() << "Kept " << tmp_file_path << " to resume at " << float(offset / pow(1024, 3)) << " GiB";
+		} else {
+			std::remove(tmp_file_path.c_str());
+			std::remove((file_path + ".resume").c_str());
+			g_log.error() << "Deleted " << tmp_file_path;
+			if(transfer.id) {
+				std::lock_guard<std::mutex> lock(g_mutex);
+				g_partials.erase(transfer.id);
+			}
+		}
 	} else {
 		if(std::rename(tmp_file_path.c_str(), file_path.c_str())) {
+			g_log.error() << "rename('" << tmp_file_path << "') failed with: " << strerror(errno);
+		} else {
+			is_stored = true;
+		}
+		if(transfer.id) {
+			std::remove((file_path + ".resume").c_str());
+			std::lock_guard<std::mutex> lock(g_mutex);
+			g_partials.erase(transfer.id);
+		}
+	}
+	if(ack_fd >= 0) {
+		// CAP_ACK: tell the client whether it's safe to delete its copy
+		const char status = is_stored ? 1 : 0;
+		const bool is_sent = ::send(ack_fd, &status, 1, 0) == 1;
+		if(keep_session && is_stored && is_sent) {
+			// CAP_SESSION: the main loop waits for the next copy on this connection
 			std::lock_guard<std::mutex> lock(g_mutex);
-			std::cerr << "rename('" << tmp_file_path << "') failed with: " << strerror(errno) << std::endl;
+			g_idle_sessions.push_back(ack_fd);
+		} else {
+			CLOSESOCKET(ack_fd);
 		}
 	}
 	{
@@ -234,67 +862,929 @@ void copy_func(const uint64_t job, const int fd, const uint64_t num_bytes, const
 		g_threads.erase(job);
 
 		if(is_drive_fail) {
-			g_failed_drives.insert(dst_path);
+			g_drives->set_failed(drive);
 		}
-		g_reserved[dst_path] -= num_bytes;
-		g_num_active[dst_path]--;
+		g_drives->release(drive, num_bytes, !num_left, transfer.num_allocated);
+
+		g_metrics.active_copies.add(-1);
+		(num_left ? g_metrics.copies_failed : g_metrics.copies_ok).add();
 
 		if(!num_left) {
+			const auto num_received = num_bytes - transfer.offset;		// resumed copies only wrote the rest
 			const auto elapsed = (get_time_millis() - time_begin) / 1e3;
-			std::cout << "Finished copy to " << file_path << ", took " << elapsed << " sec, "
-					<< num_bytes / pow(1024, 2) / elapsed << " MB/s" << std::endl;
+			g_metrics.copy_duration.observe(elapsed);
+			g_metrics.copy_throughput.observe(num_received / pow(1024, 2) / elapsed);
+			const bool is_tuned = g_drives->add_result(drive, num_received, elapsed, active_time_begin);
+			auto& stats = g_drive_stats[dst_path];
+			stats.num_jobs++;
+			stats.num_bytes += num_received;
+			stats.total_sec += elapsed;
+			stats.reader_starved_sec += job_stats.reader_starved_sec;
+			stats.writer_starved_sec += job_stats.writer_starved_sec;
+			{
+				auto line = g_log.info();
+				line << "Finished copy to " << file_path << ", took " << elapsed << " sec, "
+						<< num_received / pow(1024, 2) / elapsed << " MB/s (" << mode << ", drive average "
+						<< stats.num_bytes / pow(1024, 2) / stats.total_sec << " MB/s)";
+				if(job_stats.reader_starved_sec > 0 || job_stats.writer_starved_sec > 0) {
+					line << ", reader starved " << job_stats.reader_starved_sec << " sec (disk bound), writer starved "
+							<< job_stats.writer_starved_sec << " sec (network bound)";
+				}
+			}
+			if(phases && phases->recv_size.get_count()) {
+				g_log.info() << "Job " << job << " phases: " << phases->to_string();
+			}
+			if(is_tuned) {
+				g_log.info() << "Drive " << dst_path << ": parallel copies limit changed to " << g_drives->get(drive).max_active;
+			}
 		}
 	}
-	g_signal.notify_all();
+	wakeup_main();
 }
 
-
-int main(int argc, char** argv) try
+static
+std::shared_ptr<FileWriter> open_file(const std::string& file_path, const std::vector<buffer_t>& direct_buffers, const uint64_t offset)
 {
-#ifdef _WIN32
-	{
-		WSADATA data;
-		const int wsaret = WSAStartup(MAKEWORD(1, 1), &data);
-		if(wsaret != 0) {
-			std::cerr << "WSAStartup() failed with error: " << wsaret << "\n";
-			exit(-1);
+#ifdef __linux__
+	if(g_direct_io) {
+		try {
+			if(direct_buffers.size() >= 2) {
+				return std::make_shared<DirectWriter>(file_path, direct_buffers[0].data, direct_buffers[1].data, direct_buffers[0].capacity, offset);
+			}
+			return std::make_shared<DirectWriter>(file_path, 4 * 1024 * 1024, offset);
+		} catch(const std::exception& ex) {
+			g_log.error() << ex.what() << ", falling back to buffered I/O";
 		}
 	}
 #endif
-	
-	std::signal(SIGINT, trigger_shutdown);
-	std::signal(SIGTERM, trigger_shutdown);
-#ifndef _WIN32
-	std::signal(SIGPIPE, SIG_IGN);
-#endif
+	return std::make_shared<BufferedWriter>(file_path, offset);
+}
 
-	cxxopts::Options options("chia_plot_sink",
-		"Final copy engine to receive plots from one or more plotters via TCP and distribute to multiple disks in parallel.\n\n"
-		"Usage: chia_plot_sink -- /mnt/disk0/ /mnt/disk1/ ...\n"
+/*
+ * Feeds the first `num_bytes` of `file_path` to `hasher`, ie. what a resumed copy received before.
+ */
+static
+void hash_file(XXHash64& hasher, const std::string& file_path, uint64_t num_bytes, const buffer_t& buffer)
+{
+	std::ifstream file(file_path, std::ios::binary);
+	while(file && num_bytes) {
+		const auto num_read = std::min<uint64_t>(num_bytes, buffer.capacity);
+		if(!file.read(buffer.data, num_read)) {
+			break;
+		}
+		hasher.update(buffer.data, num_read);
+		num_bytes -= num_read;
+	}
+	if(num_bytes) {
+		throw std::runtime_error("failed to read '" + file_path + "' for checksum");
+	}
+}
+
+/*
+ * Receives `num_left` bytes from `fd` into `file`, followed by the checksum if `verify`.
+ * The checksum covers `num_kept` bytes already in the file as well (resume).
+ * Returns false if the checksum is missing or does not match.
+ */
+static
+bool receive_data(	const int fd, FileWriter& file, const drive_t& info, const std::vector<buffer_t>& recv_buffers, const bool verify,
+					const uint64_t num_kept, uint64_t& num_left, bool& is_drive_fail, drive_stats_t& stats, job_phases_t& phases,
+					const std::string& file_path)
+{
+	const auto tmp_file_path = file_path + ".tmp";
+	const auto& buffer = recv_buffers[0];
+	XXHash64 hasher;
+
+	if(verify && num_kept) {
+		try {
+			hash_file(hasher, tmp_file_path, num_kept, buffer);
+		} catch(const std::exception& ex) {
+			g_log.error() << ex.what();
+			return false;
+		}
+	}
+
+	set_socket_nonblocking(fd);
+
+	bool use_recv = true;
+#ifdef __linux__
+	if(g_use_splice && !verify && file.get_fd() >= 0) {
+		use_recv = !splice_recv(fd, file.get_fd(), num_left, is_drive_fail, tmp_file_path, phases);
+	}
+#endif
+	if(use_recv && (g_pipeline_depth > 0 || g_drive_writers || verify))
+	{
+		std::shared_ptr<DriveWriter> drive;
+		if(g_drive_writers) {
+			std::lock_guard<std::mutex> lock(g_mutex);
+			auto& writer = g_writers[info.device_name];
+			if(!writer) {
+				writer = std::make_shared<DriveWriter>(g_queue_depth);
+			}
+			drive = writer;
+		}
+		pipeline_recv(fd, file, recv_buffers, drive.get(), num_left, is_drive_fail, stats, phases, verify ? &hasher : nullptr);
+		use_recv = false;
+	}
+
+	while(use_recv && num_left)
+	{
+		const auto time_wait = job_phases_t::clock_type::now();
+		if(!poll_fd_ex(fd, POLLIN, g_recv_timeout_sec * 1000))
+		{
+			g_log.error() << "recv() failed with: timeout";
+			break;
+		}
+		phases.add_wait(job_phases_t::elapsed(time_wait));
+
+		const auto num_read = ::recv(fd, buffer.data, std::min<uint64_t>(num_left, buffer.capacity), 0);
+		if(num_read < 0) {
+			g_log.error() << "recv() failed with: " << strerror(errno);
+			break;
+		} else if(num_read == 0) {
+			g_log.error() << "recv() failed with: EOF";
+			break;
+		}
+		phases.add_recv(num_read);
+
+		const auto time_write = job_phases_t::clock_type::now();
+		try {
+			file.write(buffer.data, num_read);
+		} catch(const std::exception& ex) {
+			g_log.error() << ex.what();
+			is_drive_fail = true;
+			break;
+		}
+		phases.add_write(job_phases_t::elapsed(time_write));
+		num_left -= num_read;
+		g_metrics.received_bytes.add(num_read);
+	}
+	if(verify && !num_left) {
+		// CAP_CHECKSUM: hash of the whole file (or stripe) follows the data
+		try {
+			char tmp[8];
+			recv_bytes(tmp, fd, sizeof(tmp), g_recv_timeout_sec * 1000);
+			const auto expected = read_le(tmp, 8);
+			if(hasher.digest() != expected) {
+				g_log.error() << "Checksum mismatch for " << file_path << ": expected " << std::hex << expected
+						<< ", received data has " << hasher.digest() << std::dec;
+				return false;
+			}
+		} catch(const std::exception& ex) {
+			g_log.error() << "Failed to receive checksum: " << ex.what();
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Receives one file from `fd`, plus the other stripes from `stripe_fds` (CAP_STRIPE) into the same file.
+ */
+static
+void copy_func(	const uint64_t job, const int fd, const uint64_t num_bytes, const size_t drive, const std::string& file_name,
+				const uint64_t capabilities, transfer_t transfer, const std::vector<int> stripe_fds)
+{
+	const bool send_ack = capabilities & CAP_ACK;
+	const bool verify = capabilities & CAP_CHECKSUM;
+	const bool is_striped = !stripe_fds.empty();
+	const uint16_t num_stripes = stripe_fds.size() + 1;
+	const auto info = g_drives->get(drive);
+	const auto& dst_path = info.path;
+	const auto file_path = get_file_path(dst_path, file_name);
+	const auto tmp_file_path = file_path + ".tmp";
+
+	{
+		// a partial of another version of this file is about to be overwritten
+		std::lock_guard<std::mutex> lock(g_mutex);
+		if(transfer.offset) {
+			g_partials[transfer.id].is_active = true;
+		}
+		// the partial file holds its blocks already
+		g_drives->allocate(drive, transfer.offset, true);
+		transfer.num_allocated = transfer.offset;
+
+		for(auto iter = g_partials.begin(); iter != g_partials.end();) {
+			if(iter->first != transfer.id && iter->second.dst_path == dst_path && iter->second.file_name == file_name) {
+				std::remove((file_path + ".resume").c_str());
+				iter = g_partials.erase(iter);
+			} else {
+				iter++;
+			}
+		}
+	}
+
+	// borrow all buffers for this copy at once, including those of other stripes, checksums need a writer stage to run in
+	const size_t num_recv = std::max(g_pipeline_depth, g_drive_writers || verify ? 2 : 1);
+	const size_t num_direct = g_direct_io && g_pool && !is_striped ? 2 : 0;
+	BufferLease lease(g_pool.get(), num_recv * num_stripes + num_direct, g_buffer_size);
+
+	std::vector<buffer_t> recv_buffers = lease.buffers;
+	std::vector<buffer_t> direct_buffers;
+	if(num_direct && recv_buffers.size() > num_direct) {
+		direct_buffers.assign(recv_buffers.end() - num_direct, recv_buffers.end());
+		recv_buffers.resize(recv_buffers.size() - num_direct);
+	}
+	// one slice per stripe, g_max_stripes is limited to the pool size so each gets at least one
+	const size_t num_slice = std::max<size_t>(recv_buffers.size() / num_stripes, 1);
+	std::vector<std::vector<buffer_t>> stripe_buffers;
+	for(size_t i = 1; i < num_stripes; ++i) {
+		stripe_buffers.emplace_back(recv_buffers.begin() + i * num_slice, recv_buffers.begin() + (i + 1) * num_slice);
+	}
+	recv_buffers.resize(num_slice);
+
+	const auto throttle = [&info](std::shared_ptr<FileWriter> file) -> std::shared_ptr<FileWriter>
+	{
+		if(g_controller_limit <= 0) {
+			return file;
+		}
+		// devices without known controller are limited individually
+		const auto group = info.controller.empty() ? info.device_name : info.controller;
+		std::lock_guard<std::mutex> lock(g_mutex);
+		auto& limiter = g_limiters[group];
+		if(!limiter) {
+			limiter = std::make_shared<RateLimiter>(g_controller_limit * pow(1024, 2));
+		}
+		return std::make_shared<ThrottledWriter>(file, limiter);
+	};
+
+	bool is_drive_fail = false;
+	int file_fd = -1;		// shared by all stripes
+	std::shared_ptr<FileWriter> file;
+	try {
+		if(is_striped) {
+#ifndef _WIN32
+			file_fd = ::open(tmp_file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(file_fd < 0) {
+				throw std::runtime_error("open('" + tmp_file_path + "') failed with: " + std::string(strerror(errno)));
+			}
+			uint64_t offset = 0;
+			uint64_t size = 0;
+			get_stripe_range(num_bytes, 0, num_stripes, offset, size);
+			file = std::make_shared<RangeWriter>(file_fd, offset, tmp_file_path);
+#endif
+		} else {
+			file = open_file(tmp_file_path, direct_buffers, transfer.offset);
+		}
+		file = throttle(file);
+
+		auto line = g_log.info();
+		line << "Started copy to " << file_path << " (" << float(num_bytes / pow(1024, 3)) << " GiB, " << file->get_mode() << ")";
+		if(transfer.offset) {
+			line << ", resuming at " << float(transfer.offset / pow(1024, 3)) << " GiB";
+		}
+		if(is_striped) {
+			line << ", " << num_stripes << " stripes";
+		}
+	} catch(const std::exception& ex) {
+		g_log.error() << ex.what();
+		// a missing partial is not a drive failure, the client starts over next time
+		is_drive_fail = !transfer.offset;
+		transfer.is_resumable = false;
+	}
+	if(file && g_preallocate) {
+		try {
+			if(file->preallocate(num_bytes)) {
+				g_drives->allocate(drive, num_bytes - transfer.offset);
+				transfer.num_allocated = num_bytes;
+			}
+		} catch(const std::exception& ex) {
+			// not a drive failure, just not enough space left
+			g_log.error() << ex.what();
+			file = nullptr;
+			transfer.is_resumable = false;
+		}
+	}
+	const auto time_begin = get_time_millis();
+	const auto active_time_begin = g_drives->get_active_time(drive);
+
+	uint64_t num_left = num_bytes - transfer.offset;
+	if(is_striped) {
+		uint64_t offset = 0;
+		get_stripe_range(num_bytes, 0, num_stripes, offset, num_left);
+	}
+	drive_stats_t job_stats;
+	job_phases_t phases;
+
+	// other stripes are received in parallel, each with its own buffers
+	std::mutex stripe_mutex;
+	uint64_t stripe_left = 0;
+	bool is_stripe_fail = false;
+	std::vector<std::thread> stripe_threads;
+#ifndef _WIN32
+	for(size_t i = 0; file && i < stripe_fds.size(); ++i) {
+		stripe_threads.emplace_back([&, i]() {
+			const uint16_t index = i + 1;
+			uint64_t offset = 0;
+			uint64_t num_left = 0;
+			get_stripe_range(num_bytes, index, num_stripes, offset, num_left);
+
+			auto file = throttle(std::make_shared<RangeWriter>(file_fd, offset, tmp_file_path));
+			bool is_fail = false;
+			drive_stats_t stats;
+			const bool is_valid = receive_data(stripe_fds[i], *file, info, stripe_buffers[i], verify, 0, num_left, is_fail, stats, phases, file_path);
+
+			std::lock_guard<std::mutex> lock(stripe_mutex);
+			stripe_left += is_valid ? num_left : std::max<uint64_t>(num_left, 1);
+			is_stripe_fail = is_stripe_fail || is_fail;
+			job_stats.reader_starved_sec += stats.reader_starved_sec;
+			job_stats.writer_starved_sec += stats.writer_starved_sec;
+		});
+	}
+#endif
+	bool is_valid = true;
+	if(file) {
+		drive_stats_t stats;
+		is_valid = receive_data(fd, *file, info, recv_buffers, verify, transfer.offset, num_left, is_drive_fail, stats, phases, file_path);
+		std::lock_guard<std::mutex> lock(stripe_mutex);
+		job_stats.reader_starved_sec += stats.reader_starved_sec;
+		job_stats.writer_starved_sec += stats.writer_starved_sec;
+	}
+	if(!is_valid) {
+		num_left = num_left ? num_left : 1;
+		transfer.is_resumable = false;
+	}
+	for(auto& thread : stripe_threads) {
+		thread.join();
+	}
+	num_left += stripe_left;
+	is_drive_fail = is_drive_fail || is_stripe_fail;
+	for(const auto stripe_fd : stripe_fds) {
+		CLOSESOCKET(stripe_fd);
+	}
+	if(!send_ack) {
+		CLOSESOCKET(fd);
+	}
+
+	std::string mode;
+	if(file) {
+		mode = file->get_mode() + (verify ? ", checksum" : "");
+		try {
+			file->close();
+		} catch(const std::exception& ex) {
+			g_log.error() << ex.what();
+			is_drive_fail = true;
+			num_left = num_left ? num_left : 1;
+		}
+		file = nullptr;
+	}
+#ifndef _WIN32
+	if(file_fd >= 0 && ::close(file_fd)) {
+		g_log.error() << "close('" << tmp_file_path << "') failed with: " << strerror(errno);
+		is_drive_fail = true;
+		num_left = num_left ? num_left : 1;
+	}
+#endif
+	finish_copy(job, drive, num_bytes, dst_path, file_path, time_begin, active_time_begin, num_left, is_drive_fail, mode, job_stats, &phases,
+				send_ack ? fd : -1, transfer, send_ack && (capabilities & CAP_SESSION));
+}
+
+
+#ifdef HAVE_IO_URING
+static
+void start_uring_copy(const uint64_t job, const int fd, const uint64_t num_bytes, const size_t drive, const std::string& file_name)
+{
+	const auto info = g_drives->get(drive);
+	const auto dst_path = info.path;
+	const auto file_path = get_file_path(dst_path, file_name);
+	const auto time_begin = get_time_millis();
+	const auto active_time_begin = g_drives->get_active_time(drive);
+	const std::string mode = std::string("uring, ") + (g_direct_io ? "direct" : "buffered");
+
+	g_log.info() << "Started copy to " << file_path << " (" << float(num_bytes / pow(1024, 3)) << " GiB, " << mode << ")";
+
+	UringEngine::job_t entry;
+	entry.fd = fd;
+	entry.num_bytes = num_bytes;
+	entry.dst_key = info.device_name;
+	entry.file_path = file_path + ".tmp";
+	entry.on_data = [](size_t num_bytes) {
+		g_metrics.received_bytes.add(num_bytes);
+	};
+	// both are called by the same loop
+	const auto transfer = std::make_shared<transfer_t>();
+	entry.on_allocate = [=]() {
+		g_drives->allocate(drive, num_bytes);
+		transfer->num_allocated = num_bytes;
+	};
+	entry.on_finish = [=](uint64_t num_left, bool is_drive_fail, const std::string& error) {
+		if(!error.empty()) {
+			g_log.error() << error;
+		}
+		finish_copy(job, drive, num_bytes, dst_path, file_path, time_begin, active_time_begin, num_left, is_drive_fail, mode,
+					drive_stats_t(), nullptr, -1, *transfer);
+	};
+	g_uring->add_job(entry);
+}
+#endif
+
+/*
+ * Expands a glob pattern (ie. "/mnt/disk*") to existing directories.
+ */
+static
+std::vector<std::string> expand_pattern(const std::string& pattern)
+{
+	std::vector<std::string> out;
+#ifdef _WIN32
+	out.push_back(pattern);
+#else
+	::glob_t result = {};
+	if(::glob(pattern.c_str(), GLOB_NOCHECK, NULL, &result) == 0) {
+		for(size_t i = 0; i < result.gl_pathc; ++i) {
+			out.push_back(result.gl_pathv[i]);
+		}
+	}
+	::globfree(&result);
+#endif
+	std::vector<std::string> dirs;
+	for(const auto& path : out) {
+		try {
+			if(std::experimental::filesystem::is_directory(path)) {
+				dirs.push_back(path);
+			}
+		} catch(...) {
+			// ignore
+		}
+	}
+	return dirs;
+}
+
+/*
+ * Returns the destinations from command line and config file, with patterns expanded.
+ * The config file lists one destination or pattern per line, '#' starts a comment.
+ */
+static
+std::vector<std::string> get_destinations()
+{
+	auto patterns = g_dest_args;
+	if(!g_config_file.empty()) {
+		std::ifstream file(g_config_file);
+		if(!file) {
+			throw std::runtime_error("failed to open config: " + g_config_file);
+		}
+		std::string line;
+		while(std::getline(file, line)) {
+			line = line.substr(0, line.find('#'));
+			const auto begin = line.find_first_not_of(" \t\r");
+			const auto end = line.find_last_not_of(" \t\r");
+			if(begin != std::string::npos) {
+				patterns.push_back(line.substr(begin, end - begin + 1));
+			}
+		}
+	}
+	std::vector<std::string> out;
+	std::set<std::string> unique;
+	for(const auto& pattern : patterns) {
+		for(const auto& path : expand_pattern(pattern)) {
+			if(unique.insert(path).second) {
+				out.push_back(path);
+			}
+		}
+	}
+	return out;
+}
+
+/*
+ * Returns the id of the device holding `path`, 0 if unknown.
+ */
+static
+uint64_t get_device_id(const std::string& path)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct ::stat info = {};
+	if(::stat(path.c_str(), &info)) {
+		return 0;
+	}
+	return info.st_dev;
+#endif
+}
+
+/*
+ * Adds new destinations and removes missing ones, copies to removed drives finish normally.
+ * A destination which is now on another device than when it was added (ie. an unmounted mount point) counts as missing,
+ * unless it was not a mount point before and is one now.
+ */
+static
+void reload_destinations()
+{
+	std::vector<std::string> list;
+	try {
+		list = get_destinations();
+	} catch(const std::exception& ex) {
+		g_log.error() << "Reload failed with: " << ex.what();
+		return;
+	}
+	std::set<std::string> moved;
+	for(auto iter = list.begin(); iter != list.end();) {
+		const auto device = get_device_id(*iter);
+		const auto known = g_dest_devices.emplace(*iter, device).first;
+		if(known->second != device) {
+			const auto parent = get_device_id(*iter + "/..");
+			if(known->second == parent && device != parent) {
+				known->second = device;		// was not mounted yet when added
+			} else {
+				moved.insert(*iter);
+				iter = list.erase(iter);
+				continue;
+			}
+		}
+		iter++;
+	}
+	const std::set<std::string> paths(list.begin(), list.end());
+
+	for(const auto& drive : g_drives->get_all()) {
+		if(!drive.is_removed && !paths.count(drive.path)) {
+			g_drives->remove(drive.index);
+			auto line = g_log.info();
+			line << "Removed destination: " << drive.path;
+			if(moved.count(drive.path)) {
+				line << " (device changed, unmounted?)";
+			}
+			if(drive.num_active) {
+				line << " (" << drive.num_active << " active copies finishing)";
+			}
+		}
+	}
+	std::set<std::string> current;
+	for(const auto& drive : g_drives->get_all()) {
+		if(!drive.is_removed) {
+			current.insert(drive.path);
+		}
+	}
+	for(const auto& path : list) {
+		if(!current.count(path)) {
+			const auto drive = g_drives->get(g_drives->add(path));
+			g_log.info() << "Added destination: " << path << " (" << int(drive.available / pow(1024, 3)) << " GiB free)";
+			if(g_capabilities & CAP_RESUME) {
+				load_partials(path);
+			}
+		}
+	}
+	expire_partials();
+	wakeup_main();
+}
+
+#ifdef __linux__
+static
+std::string read_mount_table()
+{
+	std::ifstream file("/proc/self/mounts");
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+#endif
+
+/*
+ * Selects a destination with enough space for `file_size` and reserves it.
+ * Returns -1 if none is available right now.
+ */
+static
+int select_drive(const uint64_t file_size)
+{
+	return g_drives->reserve(file_size,
+		[file_size](const std::vector<drive_t>& drives) -> int {
+			return g_placement->select(drives, file_size);
+		});
+}
+
+/*
+ * Reserves the drive which holds the partial file of `client`, returns -1 if it's busy right now.
+ * If the partial can no longer be resumed it is discarded and the client starts over.
+ */
+static
+int select_resume_drive(client_t& client)
+{
+	std::string dst_path;
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		const auto iter = g_partials.find(client.transfer.id);
+		if(iter != g_partials.end()) {
+			dst_path = iter->second.dst_path;
+		}
+	}
+	bool is_usable = false;
+	for(const auto& drive : g_drives->get_all()) {
+		if(drive.path == dst_path && drive.is_usable()) {
+			is_usable = true;
+		}
+	}
+	if(!is_usable) {
+		std::lock_guard<std::mutex> lock(g_mutex);
+		discard_partial(client.transfer.id);
+		client.transfer.offset = 0;
+		return select_drive(client.file_size);
+	}
+	// space is allocated already, only wait for a free slot
+	return g_drives->reserve(client.file_size,
+		[dst_path](const std::vector<drive_t>& drives) -> int {
+			for(const auto& drive : drives) {
+				if(drive.path == dst_path && drive.is_usable() && drive.has_free_slot()) {
+					return drive.index;
+				}
+			}
+			return -1;
+		});
+}
+
+static
+void release_drive(const size_t drive, const uint64_t file_size)
+{
+	g_drives->release(drive, file_size, false);
+	wakeup_main();
+}
+
+/*
+ * Returns true if `client` is a kept connection between two copies, which may be closed any time.
+ */
+static
+bool is_idle_session(const client_t& client) {
+	return client.is_session && client.phase == PHASE_SIZE && client.offset == 0;
+}
+
+static
+void start_phase(client_t& client, const client_phase_e phase, const size_t num_bytes)
+{
+	client.phase = phase;
+	client.buffer.resize(num_bytes);
+	client.offset = 0;
+	client.deadline = get_time_millis() + int64_t(g_handshake_timeout_sec) * 1000;
+}
+
+/*
+ * Receives what is available for the current phase, returns true once complete.
+ */
+static
+bool recv_phase(client_t& client)
+{
+	while(client.offset < client.buffer.size()) {
+		const auto num_read = ::recv(client.fd, client.buffer.data() + client.offset, client.buffer.size() - client.offset, 0);
+		if(num_read < 0) {
+			if(is_socket_would_block()) {
+				return false;
+			}
+			throw std::runtime_error("recv() failed with: " + std::string(strerror(errno)));
+		} else if(num_read == 0) {
+			throw std::runtime_error("recv() failed with: EOF");
+		}
+		client.offset += num_read;
+	}
+	return true;
+}
+
+static
+void start_copy(	const uint64_t job, const int fd, const uint64_t file_size, const size_t drive, const std::string& file_name,
+					const uint64_t capabilities, const transfer_t& transfer, const std::vector<int>& stripe_fds = {})
+{
+	g_metrics.active_copies.add(1);
+
+	std::lock_guard<std::mutex> lock(g_mutex);
+#ifdef HAVE_IO_URING
+	if(g_uring) {
+		// engine jobs have no thread, but are tracked the same way
+		set_socket_nonblocking(fd, false);
+		g_threads[job] = nullptr;
+		start_uring_copy(job, fd, file_size, drive, file_name);
+		return;
+	}
+#endif
+	g_threads[job] = std::make_shared<std::thread>(&copy_func, job, fd, file_size, drive, file_name, capabilities, transfer, stripe_fds);
+}
+
+/*
+ * Renders all metrics in Prometheus text format, called from the metrics server thread.
+ * Only reads atomics and the drive table, never takes g_mutex.
+ */
+static
+std::string render_metrics()
+{
+	std::ostringstream out;
+	out.precision(15);
+	write_metric_header(out, "chia_sink_received_bytes_total", "counter", "Bytes received from plotters");
+	out << "chia_sink_received_bytes_total " << g_metrics.received_bytes.get() << "\n";
+	write_metric_header(out, "chia_sink_copies_total", "counter", "Finished copies by result");
+	out << "chia_sink_copies_total{result=\"ok\"} " << g_metrics.copies_ok.get() << "\n";
+	out << "chia_sink_copies_total{result=\"failed\"} " << g_metrics.copies_failed.get() << "\n";
+	write_metric_header(out, "chia_sink_handshakes_failed_total", "counter", "Connections which failed before the copy started");
+	out << "chia_sink_handshakes_failed_total " << g_metrics.handshakes_failed.get() << "\n";
+	write_metric_header(out, "chia_sink_log_dropped_total", "counter", "Log lines dropped because the log queue was full");
+	out << "chia_sink_log_dropped_total " << g_log.get_num_dropped() << "\n";
+	write_metric_header(out, "chia_sink_active_copies", "gauge", "Copies in progress");
+	out << "chia_sink_active_copies " << g_metrics.active_copies.get() << "\n";
+	write_metric_header(out, "chia_sink_waiting_connections", "gauge", "Connections waiting for a drive");
+	out << "chia_sink_waiting_connections " << g_metrics.waiting_clients.get() << "\n";
+	write_metric_header(out, "chia_sink_pending_handshakes", "gauge", "Connections in handshake");
+	out << "chia_sink_pending_handshakes " << g_metrics.pending_handshakes.get() << "\n";
+	if(g_pool) {
+		write_metric_header(out, "chia_sink_pool_free_buffers", "gauge", "Free buffers in shared pool");
+		out << "chia_sink_pool_free_buffers " << g_pool->get_num_free() << "\n";
+	}
+	write_metric_header(out, "chia_sink_copy_duration_seconds", "histogram", "Duration of successful copies");
+	g_metrics.copy_duration.write(out, "chia_sink_copy_duration_seconds");
+	write_metric_header(out, "chia_sink_copy_throughput_mbps", "histogram", "Throughput of successful copies [MB/s]");
+	g_metrics.copy_throughput.write(out, "chia_sink_copy_throughput_mbps");
+	write_metric_header(out, "chia_sink_recv_wait_seconds", "histogram", "Time waiting for data from the network, per recv");
+	g_metrics.recv_wait.write(out, "chia_sink_recv_wait_seconds");
+	write_metric_header(out, "chia_sink_recv_size_kib", "histogram", "Size of each recv [KiB]");
+	g_metrics.recv_size.write(out, "chia_sink_recv_size_kib");
+	write_metric_header(out, "chia_sink_write_latency_seconds", "histogram", "Time blocked in each write to disk");
+	g_metrics.write_latency.write(out, "chia_sink_write_latency_seconds");
+
+	const auto drives = g_drives ? g_drives->get_all() : std::vector<drive_t>();
+	const auto write_drives = [&](const std::string& name, const std::string& type, const std::string& help,
+									const std::function<double(const drive_t&)>& get)
+	{
+		write_metric_header(out, name, type, help);
+		for(const auto& drive : drives) {
+			out << name << "{drive=\"" << escape_label(drive.path) << "\",device=\"" << escape_label(drive.device_name) << "\"} "
+				<< int64_t(get(drive)) << "\n";
+		}
+	};
+	write_drives("chia_sink_drive_free_bytes", "gauge", "Free space as of last refresh",
+			[](const drive_t& drive) { return drive.available; });
+	write_drives("chia_sink_drive_reserved_bytes", "gauge", "Bytes reserved by active copies",
+			[](const drive_t& drive) { return drive.reserved; });
+	write_drives("chia_sink_drive_active_copies", "gauge", "Active copies to drive",
+			[](const drive_t& drive) { return drive.num_active; });
+	write_drives("chia_sink_drive_max_active", "gauge", "Limit of parallel copies on the drive's device, -1 = unlimited",
+			[](const drive_t& drive) { return drive.max_active; });
+	write_drives("chia_sink_drive_throughput_bytes", "gauge", "Recent write throughput [bytes/sec]",
+			[](const drive_t& drive) { return drive.get_throughput(); });
+	write_drives("chia_sink_drive_written_bytes_total", "counter", "Bytes written by finished copies",
+			[](const drive_t& drive) { return drive.num_bytes; });
+	write_drives("chia_sink_drive_copies_total", "counter", "Finished copies",
+			[](const drive_t& drive) { return drive.num_jobs; });
+	write_drives("chia_sink_drive_failed", "gauge", "1 if drive failed",
+			[](const drive_t& drive) { return drive.is_failed; });
+	write_drives("chia_sink_drive_disabled", "gauge", "1 if drive is disabled or removed",
+			[](const drive_t& drive) { return drive.is_disabled || drive.is_removed; });
+	return out.str();
+}
+
+int main(int argc, char** argv) try
+{
+#ifdef _WIN32
+	{
+		WSADATA data;
+		const int wsaret = WSAStartup(MAKEWORD(1, 1), &data);
+		if(wsaret != 0) {
+			std::cerr << "WSAStartup() failed with error: " << wsaret << "\n";
+			exit(-1);
+		}
+	}
+#endif
+	
+	std::signal(SIGINT, trigger_shutdown);
+	std::signal(SIGTERM, trigger_shutdown);
+#ifdef SIGHUP
+	std::signal(SIGHUP, trigger_reload);
+#endif
+#ifndef _WIN32
+	std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+	cxxopts::Options options("chia_plot_sink",
+		"Final copy engine to receive plots from one or more plotters via TCP and distribute to multiple disks in parallel.\n\n"
+		"Usage: chia_plot_sink -- /mnt/disk0/ /mnt/disk1/ ...\n"
 	);
 
-	int max_num_active = 1;
-	std::vector<std::string> dir_list;
+	int64_t memory_budget = 0;
+	bool use_huge_pages = false;
+	bool lock_memory = false;
+	bool log_json = false;
+	bool resume = true;
+	bool checksum = true;
+	auto& dir_list = g_dest_args;
 
 	options.allow_unrecognised_options().add_options()(
 		"B, address", "Address to listen on (default = 0.0.0.0)", cxxopts::value<std::string>(g_addr))(
 		"p, port", "Port to listen on (default = 1337)", cxxopts::value<int>(g_port))(
 		"T, timeout", "Receive timeout [sec] (default = 100)", cxxopts::value<int>(g_recv_timeout_sec))(
-		"r, parallel", "Maximum number of parallel copies to same drive (default = 1, infinite = -1)", cxxopts::value<int>(max_num_active))(
-		"d, destination", "List of destination folders", cxxopts::value<std::vector<std::string>>(dir_list))(
+		"H, handshake-timeout", "Timeout for each step of the connection handshake [sec] (default = 30)", cxxopts::value<int>(g_handshake_timeout_sec))(
+		"r, parallel", "Maximum number of parallel copies to same drive (default = 1, or 8 with -A, infinite = -1)", cxxopts::value<int>(g_max_num_active))(
+		"G, group-devices", "Limit parallel copies per physical device instead of per directory, disable with --group-devices=false (default = true)", cxxopts::value<bool>(g_group_devices)->default_value("true"))(
+		"controller-limit", "Maximum write throughput per disk controller [MB/s], 0 = unlimited (default = 0)", cxxopts::value<int>(g_controller_limit))(
+		"A, adaptive", "Tune number of parallel copies per drive by measured throughput, up to -r (default = off)", cxxopts::value<bool>(g_adaptive))(
+		"refresh-interval", "Interval to refresh free space of drives [sec] (default = 10)", cxxopts::value<int>(g_refresh_sec))(
+		"placement", "Drive placement policy: most-free, round-robin, fill-first, lru, throughput, eta (default = most-free)", cxxopts::value<std::string>(g_placement_name))(
+		"admission", "Order in which waiting plotters get a drive: fifo, size (smaller files may overtake) (default = fifo)", cxxopts::value<std::string>(g_admission))(
+		"S, splice", "Use zero-copy splice() to receive data, falls back to recv() if not supported (Linux only)", cxxopts::value<bool>(g_use_splice))(
+		"D, direct", "Use direct I/O (O_DIRECT) to write files, bypassing the page cache (Linux only)", cxxopts::value<bool>(g_direct_io))(
+		"P, prealloc", "Preallocate files to their full size, disable with --prealloc=false (default = true)", cxxopts::value<bool>(g_preallocate)->default_value("true"))(
+		"checksum", "Verify data with a hash computed by clients that support it, disable with --checksum=false (default = true)", cxxopts::value<bool>(checksum)->default_value("true"))(
+		"session-timeout", "Time to keep an idle client connection open for its next copy [sec], 0 = close after each copy (default = 600)", cxxopts::value<int>(g_session_timeout_sec))(
+		"max-stripes", "Maximum number of connections per file for clients that support striping, 1 = disabled (default = 16)", cxxopts::value<int>(g_max_stripes))(
+		"partial-max-age", "Delete kept partial files not resumed within this time, at startup and on reload [hours], 0 = never (default = 24)", cxxopts::value<int>(g_partial_max_age_hours))(
+		"resume", "Keep partial files of interrupted copies for clients to resume, disable with --resume=false (default = true)", cxxopts::value<bool>(resume)->default_value("true"))(
+		"b, buffers", "Number of buffers per copy to decouple network and disk, 0 = disabled (default = 0)", cxxopts::value<int>(g_pipeline_depth))(
+		"M, memory", "Total buffer memory shared by all copies [MiB], 0 = unlimited (default = 0)", cxxopts::value<int64_t>(memory_budget))(
+		"huge-pages", "Use huge pages for buffer pool (requires -M)", cxxopts::value<bool>(use_huge_pages))(
+		"mlock", "Lock buffer pool in RAM (requires -M)", cxxopts::value<bool>(lock_memory))(
+		"E, engine", "Copy engine: thread, uring (default = thread)", cxxopts::value<std::string>(g_engine))(
+		"W, drive-writers", "Use one shared writer thread per drive for all copies to it", cxxopts::value<bool>(g_drive_writers))(
+		"Q, queue-depth", "Maximum number of writes queued per drive, for uring engine and drive writers (default = 4)", cxxopts::value<int>(g_queue_depth))(
+		"L, loops", "Number of event loops for uring engine (default = 1)", cxxopts::value<int>(g_num_loops))(
+		"log-json", "Print log as one JSON object per line", cxxopts::value<bool>(log_json))(
+		"metrics-port", "Port to serve Prometheus metrics on, 0 = disabled (default = 0)", cxxopts::value<int>(g_metrics_port))(
+		"c, config", "Config file with one destination folder or pattern per line, reloaded on SIGHUP", cxxopts::value<std::string>(g_config_file))(
+		"watch-mounts", "Reload destinations when file systems are mounted or unmounted (Linux only)", cxxopts::value<bool>(g_watch_mounts))(
+		"d, destination", "List of destination folders, may contain patterns like /mnt/disk*", cxxopts::value<std::vector<std::string>>(dir_list))(
 		"help", "Print help");
 
 	options.parse_positional("destination");
 
 	const auto args = options.parse(argc, argv);
 
-	if(args.count("help") || dir_list.empty()) {
+	if(args.count("help") || (dir_list.empty() && g_config_file.empty())) {
 		std::cout << options.help({""}) << std::endl;
 		return 0;
 	}
-	for(const auto& dir : dir_list) {
-		std::cout << "Final Directory: " << dir << " (" << int(std::experimental::filesystem::space(dir).available / pow(1024, 3)) << " GiB free)" << std::endl;
+	g_log.set_json(log_json);
+
+	if(!resume) {
+		g_capabilities &= ~uint64_t(CAP_RESUME);
+	}
+	if(!checksum || g_use_splice) {
+		// splice() never sees the data
+		g_capabilities &= ~uint64_t(CAP_CHECKSUM);
+	}
+	if(g_session_timeout_sec <= 0) {
+		g_capabilities &= ~uint64_t(CAP_SESSION);
+	}
+
+	if(memory_budget > 0) {
+		const size_t num_slabs = (memory_budget * 1024 * 1024) / g_buffer_size;
+		g_pool = std::make_shared<BufferPool>(g_buffer_size, num_slabs, use_huge_pages, lock_memory);
+		g_log.info() << "Buffer pool: " << g_pool->get_num_slabs() << " x " << g_buffer_size / 1024 << " KiB"
+				<< (g_pool->is_huge_pages() ? ", huge pages" : "") << (g_pool->is_memory_locked() ? ", locked" : "");
+		if(lock_memory && !g_pool->is_memory_locked()) {
+			g_log.error() << "mlock() failed with: " << g_pool->get_lock_error();
+		}
+		if(g_direct_io && g_pool->get_num_slabs() < 3) {
+			// each copy needs one receive buffer besides the two for O_DIRECT
+			g_log.error() << "Buffer pool too small for direct I/O, its buffers are allocated outside the memory budget";
+		}
+		// every stripe needs a buffer of its own
+		g_max_stripes = std::min<int>(g_max_stripes, g_pool->get_num_slabs());
+	}
+#ifdef _WIN32
+	g_max_stripes = 1;		// no pwrite()
+#endif
+	if(g_max_stripes <= 1) {
+		g_capabilities &= ~uint64_t(CAP_STRIPE);
+	}
+	if(g_engine == "uring") {
+#ifdef HAVE_IO_URING
+		try {
+			g_uring = std::make_shared<UringEngine>(g_num_loops, g_queue_depth, 4, 1024 * 1024, g_recv_timeout_sec, g_direct_io, g_preallocate, g_pool.get());
+			g_capabilities &= ~uint64_t(CAP_ACK | CAP_RESUME | CAP_CHECKSUM | CAP_STRIPE | CAP_SESSION);		// engine closes the socket itself and only receives file data
+			g_log.info() << "Using io_uring engine with " << g_num_loops << " loop(s), queue depth " << g_queue_depth;
+		} catch(const std::exception& ex) {
+			g_log.error() << "Failed to create io_uring engine (" << ex.what() << "), falling back to threads";
+		}
+#else
+		g_log.error() << "io_uring engine not supported in this build, falling back to threads";
+#endif
+	} else if(g_engine != "thread") {
+		throw std::logic_error("invalid engine: " + g_engine);
+	}
+	g_placement = create_placement(g_placement_name);
+
+#ifdef HAVE_IO_URING
+	if(g_controller_limit > 0 && g_uring) {
+		g_log.error() << "Note: --controller-limit is not supported by the uring engine";
+	}
+#endif
+	if(g_admission != "fifo" && g_admission != "size") {
+		throw std::logic_error("invalid admission: " + g_admission);
+	}
+	if(g_adaptive) {
+		// -r is the upper bound when tuning
+		g_max_num_active = args.count("parallel") ? (g_max_num_active < 0 ? 32 : g_max_num_active) : 8;
+	}
+	g_max_num_active = g_max_num_active ? g_max_num_active : 1;
+	g_drives = std::make_shared<DriveRegistry>(get_destinations(), g_max_num_active, g_adaptive, g_group_devices, std::max(g_refresh_sec, 1), &wakeup_main);
+	for(const auto& drive : g_drives->get_all()) {
+		g_dest_devices[drive.path] = get_device_id(drive.path);
+	}
+
+	for(const auto& drive : g_drives->get_all()) {
+		auto line = g_log.info();
+		line << "Final Directory: " << drive.path << " (" << int(drive.available / pow(1024, 3)) << " GiB free";
+		if(g_group_devices) {
+			line << ", device " << drive.device_name;
+			if(!drive.controller.empty()) {
+				line << " on " << drive.controller;
+			}
+		}
+		line << (drive.is_disabled ? ", disabled" : "") << ")";
+	}
+	if(g_capabilities & CAP_RESUME) {
+		for(const auto& drive : g_drives->get_all()) {
+			load_partials(drive.path);
+		}
+		expire_partials();
 	}
+	g_log.info() << "Placement: " << g_placement->get_name() << ", admission: " << g_admission;
 
 	// create server socket
 	g_server = ::socket(AF_INET, SOCK_STREAM, 0);
@@ -304,7 +1794,7 @@ int main(int argc, char** argv) try
 	{
 		int enable = 1;
 		if(::setsockopt(g_server, SOL_SOCKET, SO_REUSEADDR, (char*)&enable, sizeof(int)) < 0) {
-			std::cerr << "setsockopt(SO_REUSEADDR) failed with: " << get_socket_error_text() << std::endl;
+			g_log.error() << "setsockopt(SO_REUSEADDR) failed with: " << get_socket_error_text();
 		}
 	}
 	{
@@ -316,139 +1806,454 @@ int main(int argc, char** argv) try
 	if(::listen(g_server, 1000) < 0) {
 		throw std::runtime_error("listen() failed with: " + get_socket_error_text());
 	}
-	std::cout << "Listening on " << g_addr << ":" << g_port << std::endl;
+	g_log.info() << "Listening on " << g_addr << ":" << g_port;
+
+	std::shared_ptr<MetricsServer> metrics_server;
+	if(g_metrics_port > 0) {
+		metrics_server = std::make_shared<MetricsServer>(get_sockaddr_byname(g_addr, g_metrics_port), &render_metrics);
+		g_log.info() << "Serving metrics on " << g_addr << ":" << g_metrics_port << "/metrics";
+	}
 
 	uint64_t job_counter = 0;
-	std::default_random_engine rand_engine;
+
+	Poller poller;
+	set_socket_nonblocking(g_server);
+	poller.add(g_server, POLLIN);
+#ifndef _WIN32
+	if(::pipe(g_wakeup_fd)) {
+		throw std::runtime_error("pipe() failed with: " + std::string(strerror(errno)));
+	}
+	set_socket_nonblocking(g_wakeup_fd[0]);
+	set_socket_nonblocking(g_wakeup_fd[1]);
+	poller.add(g_wakeup_fd[0], POLLIN);
+#endif
+
+	std::map<int, std::shared_ptr<client_t>> clients;
+	std::deque<std::shared_ptr<client_t>> waiting;
+
+	std::map<uint64_t, std::shared_ptr<client_t>> stripe_leaders;		// stripe 0 of striped copies waiting for a drive
+
+	const auto drop_client = [&](std::shared_ptr<client_t> client, const std::string& error)
+	{
+		const auto iter = clients.find(client->fd);
+		if(iter == clients.end() || iter->second != client) {
+			return;		// dropped with its stripe 0 already
+		}
+		poller.remove(client->fd);
+		CLOSESOCKET(client->fd);
+		clients.erase(client->fd);
+		waiting.erase(std::remove(waiting.begin(), waiting.end(), client), waiting.end());
+		if(client->drive >= 0) {
+			release_drive(client->drive, client->file_size);
+		}
+		if(client->num_stripes > 1) {
+			const auto leader = stripe_leaders.find(client->stripe_id);
+			if(leader != stripe_leaders.end()) {
+				auto& list = leader->second->stripes;
+				list.erase(std::remove(list.begin(), list.end(), client), list.end());
+				if(leader->second == client) {
+					stripe_leaders.erase(leader);
+				}
+			}
+			for(const auto& stripe : client->stripes) {
+				poller.remove(stripe->fd);
+				CLOSESOCKET(stripe->fd);
+				clients.erase(stripe->fd);
+			}
+			client->stripes.clear();
+		}
+		if(!error.empty()) {
+			g_metrics.handshakes_failed.add();
+			g_log.error() << "Connection from " << client->address << " failed with: " << error;
+		}
+	};
+
+	// version 2: answer the hello, then wait for a drive
+	const auto begin_wait = [&](std::shared_ptr<client_t> client)
+	{
+		if(!(client->capabilities & CAP_STRIPE)) {
+			client->num_stripes = 1;
+		}
+		if(client->num_stripes > g_max_stripes && client->stripe_index == 0) {
+			// too many stripes, tell the client to send over this connection only
+			client->capabilities &= ~uint64_t(CAP_STRIPE);
+			client->num_stripes = 1;
+		}
+		if(client->num_stripes > 1) {
+			if(client->num_stripes > g_max_stripes || client->stripe_index >= client->num_stripes) {
+				throw std::runtime_error("invalid stripe " + std::to_string(client->stripe_index) + " / " + std::to_string(client->num_stripes));
+			}
+			// striped copies are not resumed
+			client->capabilities &= ~uint64_t(CAP_RESUME);
+		}
+		char hello[PROTOCOL_SINK_HELLO_SIZE];
+		::memcpy(hello, PROTOCOL_MAGIC, 8);
+		write_le(hello + 8, client->version, 2);
+		write_le(hello + 10, client->capabilities, 8);
+		send_bytes(client->fd, hello, sizeof(hello));
+
+		if(client->num_stripes > 1) {
+			{
+				std::lock_guard<std::mutex> lock(g_mutex);
+				discard_partial(client->transfer.id);
+			}
+			client->phase = PHASE_WAIT;
+			client->wait_begin = get_time_millis();
+
+			if(client->stripe_index == 0) {
+				if(!stripe_leaders.emplace(client->stripe_id, client).second) {
+					throw std::runtime_error("duplicate stripe id");
+				}
+				waiting.push_back(client);
+				return;
+			}
+			// other stripes wait with stripe 0
+			const auto iter = stripe_leaders.find(client->stripe_id);
+			if(iter == stripe_leaders.end()) {
+				throw std::runtime_error("unknown stripe id");
+			}
+			const auto leader = iter->second;
+			if(leader->num_stripes != client->num_stripes || leader->file_size != client->file_size || leader->file_name != client->file_name) {
+				throw std::runtime_error("stripe does not match stripe 0");
+			}
+			for(const auto& stripe : leader->stripes) {
+				if(stripe->stripe_index == client->stripe_index) {
+					throw std::runtime_error("duplicate stripe " + std::to_string(client->stripe_index));
+				}
+			}
+			leader->stripes.push_back(client);
+			return;
+		}
+		if(client->capabilities & CAP_RESUME) {
+			client->transfer.is_resumable = true;
+			std::lock_guard<std::mutex> lock(g_mutex);
+			const auto iter = g_partials.find(client->transfer.id);
+			if(iter != g_partials.end()) {
+				const auto& partial = iter->second;
+				if(partial.file_name == client->file_name && partial.file_size == client->file_size && partial.offset < client->file_size) {
+					client->transfer.offset = partial.offset;
+					iter->second.time_kept = get_file_time();		// don't expire while the client waits for a slot
+				} else {
+					discard_partial(client->transfer.id);
+				}
+			}
+		}
+		client->phase = PHASE_WAIT;
+		client->wait_begin = get_time_millis();
+		waiting.push_back(client);
+	};
+
+	// version 2: receive the fields of offered capabilities, in order of capability bits (same as phases)
+	const auto continue_hello = [&](std::shared_ptr<client_t> client)
+	{
+		if(client->phase < PHASE_TRANSFER_ID && (client->offered & CAP_RESUME)) {
+			start_phase(*client, PHASE_TRANSFER_ID, 8);
+		} else if(client->phase < PHASE_STRIPE && (client->offered & CAP_STRIPE)) {
+			start_phase(*client, PHASE_STRIPE, 12);
+		} else {
+			begin_wait(client);
+		}
+	};
+
+#ifdef __linux__
+	auto mount_table = g_watch_mounts ? read_mount_table() : std::string();
+	int64_t mount_check_time = get_time_millis();
+#endif
 
 	while(g_do_run)
 	{
-		const int fd = ::accept(g_server, 0, 0);
-		if(!g_do_run) {
-			CLOSESOCKET(fd);
-			break;
+		if(g_reload) {
+			g_reload = 0;
+			reload_destinations();
 		}
-		if(fd >= 0) {
-			try {
-				uint64_t file_size = 0;
-				recv_bytes(&file_size, fd, 8);
-
-				size_t wait_counter = 0;
-				std::shared_ptr<std::string> out;
-				while(!out) {
-					std::unique_lock<std::mutex> lock(g_mutex);
-
-					// first get drives which have no active copy operations
-					std::vector<std::pair<std::string, uint64_t>> dirs;
-					for(const auto& dir : dir_list) {
-						if(!g_failed_drives.count(dir) && g_num_active[dir] == 0) {
-							try {
-								const auto available = std::experimental::filesystem::space(dir).available;
-								if(available > 0) {
-									dirs.emplace_back(dir, available);
-								}
-							} catch(const std::exception& ex) {
-								std::cout << "Failed to get free space for " << dir << " (" << ex.what() << ")" << std::endl;
-							}
-						}
+		// take back connections of finished copies, to wait for their next copy
+		{
+			std::vector<int> list;
+			{
+				std::lock_guard<std::mutex> lock(g_mutex);
+				list.swap(g_idle_sessions);
+			}
+			for(const auto fd : list) {
+				auto client = std::make_shared<client_t>();
+				client->fd = fd;
+				client->address = get_peer_address(fd);
+				client->is_session = true;
+				try {
+					set_socket_nonblocking(fd);
+					poller.add(fd, POLLIN);
+				} catch(const std::exception& ex) {
+					CLOSESOCKET(fd);
+					g_log.error() << "Failed to keep connection from " << client->address << ": " << ex.what();
+					continue;
+				}
+				start_phase(*client, PHASE_SIZE, 8);
+				client->deadline = get_time_millis() + int64_t(g_session_timeout_sec) * 1000;
+				clients[fd] = client;
+			}
+		}
+#ifdef __linux__
+		if(g_watch_mounts && get_time_millis() - mount_check_time > 5000) {
+			auto table = read_mount_table();
+			if(table != mount_table) {
+				mount_table.swap(table);
+				reload_destinations();
+			}
+			mount_check_time = get_time_millis();
+		}
+#endif
+		// assign drives to waiting clients, in order of arrival
+		{
+			std::vector<std::shared_ptr<client_t>> admitted;
+			uint64_t min_rejected = uint64_t(-1);
+			for(auto iter = waiting.begin(); iter != waiting.end();)
+			{
+				auto client = *iter;
+				if(client->stripes.size() + 1 < client->num_stripes) {
+					++iter;		// other stripes still connecting
+					continue;
+				}
+				if(client->file_size >= min_rejected) {
+					++iter;		// a smaller file did not fit either
+					continue;
+				}
+				client->drive = client->transfer.offset ? select_resume_drive(*client) : select_drive(client->file_size);
+				if(client->drive < 0) {
+					if(!client->wait_counter++) {
+						g_log.info() << "Waiting for previous copy to finish or more space ("
+								<< float(client->file_size / pow(1024, 3)) << " GiB) to become available, "
+								<< waiting.size() << " in queue ... ";
 					}
-					// sort by free space
-					std::sort(dirs.begin(), dirs.end(),
-						[](const std::pair<std::string, uint64_t>& L, const std::pair<std::string, uint64_t>& R) -> bool {
-							return L.second > R.second;
+					if(client->transfer.offset) {
+						++iter;		// only waits for a slot on the drive of its partial, says nothing about others
+						continue;
+					}
+					min_rejected = client->file_size;
+					// size-aware: smaller files may overtake, unless the head has waited too often already
+					if(g_admission != "size" || waiting.front()->num_overtaken >= g_max_overtake) {
+						break;
+					}
+					++iter;
+					continue;
+				}
+				for(auto it = waiting.begin(); it != iter; ++it) {
+					(*it)->num_overtaken++;
+				}
+				client->dst_path = g_drives->get_path(client->drive);
+				iter = waiting.erase(iter);
+				admitted.push_back(client);
+			}
+			for(const auto& client : admitted) {
+				try {
+					auto stripes = client->stripes;
+					std::sort(stripes.begin(), stripes.end(),
+						[](const std::shared_ptr<client_t>& lhs, const std::shared_ptr<client_t>& rhs) {
+							return lhs->stripe_index < rhs->stripe_index;
 						});
+					stripes.insert(stripes.begin(), client);
 
-					// append drives which are already busy
-					{
-						std::vector<std::pair<std::string, uint64_t>> tmp;
-						for(const auto& dir : dir_list) {
-							const auto num_active = g_num_active[dir];
-							if(!g_failed_drives.count(dir) && num_active > 0 && (num_active < max_num_active || max_num_active < 0)) {
-								try {
-									const auto available = std::experimental::filesystem::space(dir).available;
-									if(available > 0) {
-										tmp.emplace_back(dir, available);
-									}
-								} catch(...) {
-									// ignore
-								}
-							}
+					for(const auto& stripe : stripes) {
+						const char cmd = 1;
+						send_bytes(stripe->fd, &cmd, 1);
+						if(stripe->capabilities & CAP_RESUME) {
+							char offset[8];
+							write_le(offset, stripe->transfer.offset, 8);
+							send_bytes(stripe->fd, offset, sizeof(offset));
 						}
-						std::sort(tmp.begin(), tmp.end(),
-							[](const std::pair<std::string, uint64_t>& L, const std::pair<std::string, uint64_t>& R) -> bool {
-								return g_num_active[L.first] < g_num_active[R.first];
-							});
-						dirs.insert(dirs.end(), tmp.begin(), tmp.end());
 					}
-
-					// select a drive with enough space available
-					for(const auto& entry : dirs)
-					{
-						const auto& dir = entry.first;
-						if(entry.second > g_reserved[dir] + file_size + 4096)
-						{
-							const auto prefix = dir + char(std::experimental::filesystem::path::preferred_separator);
-							try {
-								// check if this folder is disabled
-								if(		!std::experimental::filesystem::exists(prefix + "chia_plot_sink_disable")
-									&&	!std::experimental::filesystem::exists(prefix + "chia_plot_sink_disable.txt"))
-								{
-									out = std::make_shared<std::string>(dir);
-									break;
-								}
-							} catch(...) {
-								// ignore
+					if(client->version >= 2) {
+						// file name is known already
+						std::vector<int> stripe_fds;
+						for(const auto& stripe : stripes) {
+							poller.remove(stripe->fd);
+							clients.erase(stripe->fd);
+							if(stripe != client) {
+								stripe_fds.push_back(stripe->fd);
 							}
 						}
+						stripe_leaders.erase(client->stripe_id);
+						start_copy(	job_counter++, client->fd, client->file_size, client->drive, client->file_name,
+									client->capabilities, client->transfer, stripe_fds);
+					} else {
+						start_phase(*client, PHASE_NAME_LEN, 2);
 					}
-					if(!out) {
-						if(!wait_counter++) {
-							std::cout << "Waiting for previous copy to finish or more space ("
-									<< float(file_size / pow(1024, 3)) << " GiB) to become available ... " << std::endl;
-						}
-						g_signal.wait_for(lock, std::chrono::seconds(1));
+				} catch(const std::exception& ex) {
+					drop_client(client, ex.what());
+					continue;
+				}
+				if(client->wait_counter) {
+					g_log.info() << "Admitted " << client->address << " to " << client->dst_path << " after waiting "
+							<< (get_time_millis() - client->wait_begin) / 1000 << " sec";
+				}
+			}
+		}
+
+		{
+			// stripes wait with their stripe 0, their handshake is done as well
+			size_t num_parked = 0;
+			for(const auto& entry : stripe_leaders) {
+				num_parked += entry.second->stripes.size();
+			}
+			g_metrics.waiting_clients.set(waiting.size());
+			g_metrics.pending_handshakes.set(clients.size() - waiting.size() - num_parked);
+		}
 
-						// check if connection still alive
-						if(poll_fd_ex(fd, POLLIN, 0)) {
-							throw std::runtime_error("connection closed");
+		// wait for events, at most until the next handshake deadline
+		int64_t timeout_ms = 1000;
+		const auto now = get_time_millis();
+		for(const auto& entry : clients) {
+			const auto& client = entry.second;
+			if(client->phase != PHASE_WAIT) {
+				timeout_ms = std::max<int64_t>(std::min(timeout_ms, client->deadline - now), 0);
+			}
+		}
+#ifdef _WIN32
+		timeout_ms = std::min<int64_t>(timeout_ms, 100);
+#endif
+		for(const auto& event : poller.wait(timeout_ms))
+		{
+			if(event.fd == g_server) {
+				while(g_do_run) {
+					::sockaddr_in addr = {};
+					::socklen_t addr_len = sizeof(addr);
+					const int fd = ::accept(g_server, (::sockaddr*)&addr, &addr_len);
+					if(fd < 0) {
+						if(!is_socket_would_block()) {
+							g_log.error() << "accept() failed with: " << get_socket_error_text();
 						}
-					}
-					if(!g_do_run) {
 						break;
 					}
+					auto client = std::make_shared<client_t>();
+					client->fd = fd;
+					client->address = std::string(::inet_ntoa(addr.sin_addr)) + ":" + std::to_string(ntohs(addr.sin_port));
+					try {
+						set_socket_nonblocking(fd);
+						set_socket_keepalive(fd);
+						poller.add(fd, POLLIN);
+					} catch(const std::exception& ex) {
+						CLOSESOCKET(fd);
+						g_log.error() << "accept() failed with: " << ex.what();
+						continue;
+					}
+					start_phase(*client, PHASE_SIZE, 8);
+					clients[fd] = client;
 				}
-				if(!g_do_run) {
-					CLOSESOCKET(fd);
-					break;
+				continue;
+			}
+#ifndef _WIN32
+			if(event.fd == g_wakeup_fd[0]) {
+				char tmp[256];
+				while(::read(g_wakeup_fd[0], tmp, sizeof(tmp)) > 0);
+				continue;
+			}
+#endif
+			auto iter = clients.find(event.fd);
+			if(iter == clients.end()) {
+				continue;
+			}
+			const auto client = iter->second;
+			try {
+				if(client->phase == PHASE_WAIT) {
+					// client does not send anything while waiting
+					throw std::runtime_error("connection closed");
 				}
-				{
-					const char cmd = 1;
-					send_bytes(fd, &cmd, 1);
+				if(!recv_phase(*client)) {
+					continue;
 				}
-				uint16_t file_name_len = 0;
-				recv_bytes(&file_name_len, fd, 2);
-
-				std::vector<char> file_name(file_name_len);
-				recv_bytes(file_name.data(), fd, file_name_len);
+				switch(client->phase) {
+					case PHASE_SIZE:
+						if(is_protocol_magic(client->buffer.data())) {
+							start_phase(*client, PHASE_HELLO, PROTOCOL_CLIENT_HELLO_SIZE - 8);
+							break;
+						}
+						::memcpy(&client->file_size, client->buffer.data(), 8);
+						client->phase = PHASE_WAIT;
+						client->wait_begin = get_time_millis();
+						waiting.push_back(client);
+						break;
+					case PHASE_HELLO: {
+						const auto* hello = client->buffer.data();
+						const auto version = read_le(hello, 2);
+						if(version < 2) {
+							throw std::runtime_error("invalid protocol version " + std::to_string(version));
+						}
+						client->version = std::min<uint16_t>(version, PROTOCOL_VERSION);
+						client->offered = read_le(hello + 2, 8);
+						client->capabilities = client->offered & g_capabilities;
+						client->file_size = read_le(hello + 10, 8);
+						start_phase(*client, PHASE_NAME, read_le(hello + 18, 2));
+						break;
+					}
+					case PHASE_NAME_LEN: {
+						uint16_t file_name_len = 0;
+						::memcpy(&file_name_len, client->buffer.data(), 2);
+						start_phase(*client, PHASE_NAME, file_name_len);
+					}
+					[[fallthrough]];
+					case PHASE_NAME: {
+						if(!recv_phase(*client)) {
+							break;
+						}
+						const std::string file_name(client->buffer.data(), client->buffer.size());
+						if(client->version >= 2) {
+							client->file_name = file_name;
+							continue_hello(client);
+							break;
+						}
+						if(client->drive < 0) {
+							throw std::logic_error("no drive assigned");
+						}
+						poller.remove(client->fd);
+						clients.erase(client->fd);
+						start_copy(job_counter++, client->fd, client->file_size, client->drive, file_name, 0, transfer_t());
+						break;
+					}
+					case PHASE_TRANSFER_ID:
+						client->transfer.id = read_le(client->buffer.data(), 8);
+						continue_hello(client);
+						break;
+					case PHASE_STRIPE: {
+						const auto* stripe = client->buffer.data();
+						client->stripe_id = read_le(stripe, 8);
+						client->stripe_index = read_le(stripe + 8, 2);
+						client->num_stripes = std::max<uint16_t>(read_le(stripe + 10, 2), 1);
+						continue_hello(client);
+						break;
+					}
+					default:
+						break;
+				}
+			} catch(const std::exception& ex) {
+				drop_client(client, is_idle_session(*client) ? "" : ex.what());
+			}
+		}
 
-				const auto dst_path = *out;
+		// drop clients which did not complete the current phase in time
+		{
+			std::vector<std::shared_ptr<client_t>> expired;
+			const auto now = get_time_millis();
+			for(const auto& entry : clients) {
+				const auto& client = entry.second;
+				if(client->phase != PHASE_WAIT && now >= client->deadline) {
+					expired.push_back(client);
+				}
+				if(client->phase == PHASE_WAIT && client->stripe_index == 0 && client->stripes.size() + 1 < client->num_stripes
+					&& now - client->wait_begin >= int64_t(g_handshake_timeout_sec) * 1000)
 				{
-					std::lock_guard<std::mutex> lock(g_mutex);
-					g_reserved[dst_path] += file_size;
-					g_num_active[dst_path]++;
-					g_threads[job_counter] = std::make_shared<std::thread>(&copy_func,
-							job_counter, fd, file_size, dst_path, std::string(file_name.data(), file_name.size()));
+					expired.push_back(client);		// other stripes did not connect
 				}
-				job_counter++;
 			}
-			catch(const std::exception& ex) {
-				CLOSESOCKET(fd);
-				std::lock_guard<std::mutex> lock(g_mutex);
-				std::cerr << "accept() failed with: " << ex.what() << std::endl;
+			for(const auto& client : expired) {
+				drop_client(client, is_idle_session(*client) ? "" : "handshake timeout");
 			}
-		} else {
-			std::cerr << "accept() failed with: " << get_socket_error_text() << std::endl;
-			break;
+		}
+	}
+	{
+		std::vector<std::shared_ptr<client_t>> list;
+		for(const auto& entry : clients) {
+			list.push_back(entry.second);
+		}
+		for(const auto& client : list) {
+			drop_client(client, "");
 		}
 	}
 	CLOSESOCKET(g_server);
@@ -456,20 +2261,56 @@ int main(int argc, char** argv) try
 	{
 		std::unique_lock<std::mutex> lock(g_mutex);
 		if(!g_threads.empty()) {
-			std::cout << "Waiting for jobs to finish ..." << std::endl;
+			g_log.info() << "Waiting for jobs to finish ...";
 		}
 		while(!g_threads.empty()) {
 			g_signal.wait(lock);
 		}
+		for(const auto fd : g_idle_sessions) {
+			CLOSESOCKET(fd);
+		}
+		g_idle_sessions.clear();
 	}
-	for(const auto& path : g_failed_drives) {
-		std::cout << "Failed drive: " << path << std::endl;
+	metrics_server = nullptr;
+#ifdef HAVE_IO_URING
+	g_uring = nullptr;
+#endif
+	for(const auto& drive : g_drives->get_all()) {
+		const auto iter = g_drive_stats.find(drive.path);
+		if(iter == g_drive_stats.end()) {
+			continue;
+		}
+		const auto& stats = iter->second;
+		auto line = g_log.info();
+		line << "Drive " << drive.path << ": " << stats.num_jobs << " copies, "
+				<< stats.num_bytes / pow(1024, 3) << " GiB, " << stats.num_bytes / pow(1024, 2) / stats.total_sec << " MB/s"
+				<< ", recent " << drive.get_throughput() / pow(1024, 2) << " MB/s";
+		if(stats.reader_starved_sec > 0 || stats.writer_starved_sec > 0) {
+			line << ", reader starved " << stats.reader_starved_sec << " sec, writer starved " << stats.writer_starved_sec << " sec";
+		}
+		if(auto writer = g_writers[drive.device_name]) {
+			line << ", writer idle " << writer->get_idle_time() << " sec";
+		}
+	}
+	g_writers.clear();
+
+	for(const auto& drive : g_drives->get_all()) {
+		if(drive.is_failed) {
+			g_log.info() << "Failed drive: " << drive.path;
+		}
+	}
+	if(const auto num_dropped = g_log.get_num_dropped()) {
+		g_log.error() << "Dropped " << num_dropped << " log lines";
 	}
+	g_log.flush();
+
+	g_drives = nullptr;
 #ifdef _WIN32
 	WSACleanup();
 #endif
 	return 0;
 }
 catch(const std::exception& ex) {
+	g_log.flush();
 	std::cerr << "Failed with: " << ex.what() << std::endl;
 }